@@ -0,0 +1,506 @@
+/**
+ *
+ * GzipInflater.cpp: Streaming gzip decoder for HTTP responses
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 InfluxData
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+#include "GzipInflater.h"
+
+// Decoder follows the DEFLATE format specification (RFC 1951) in the simple, table-less way,
+// which decodes Huffman codes bit by bit. It is slower than table based decoders, but it needs very little memory.
+
+// Base lengths and extra bits for length symbols 257..285
+static const uint16_t LengthBase[] PROGMEM = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LengthExtra[] PROGMEM = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+// Base distances and extra bits for distance symbols 0..29
+static const uint16_t DistanceBase[] PROGMEM = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DistanceExtra[] PROGMEM = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// Order of code length code lengths in dynamic block header
+static const uint8_t CodeLengthOrder[] PROGMEM = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+// CRC-32 lookup table for 4 bits at once
+static const uint32_t CrcTable[] PROGMEM = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+
+// Gzip header flags
+#define GZIP_FLAG_HCRC    0x02
+#define GZIP_FLAG_EXTRA   0x04
+#define GZIP_FLAG_NAME    0x08
+#define GZIP_FLAG_COMMENT 0x10
+
+GzipInflater::GzipInflater(WiFiClient *client, int size, bool chunked, uint16_t timeout):
+    _client(client), _remaining(chunked ? -1 : size), _chunked(chunked), _timeout(timeout) {
+}
+
+bool GzipInflater::inflate(String &output) {
+    _result = &output;
+    if(!_client) {
+        setError(F("No response stream"));
+        return false;
+    }
+    if(!readHeader()) {
+        return false;
+    }
+    bool last;
+    do {
+        last = bits(1);
+        uint8_t type = bits(2);
+        bool ok;
+        switch(type) {
+            case 0:
+                ok = storedBlock();
+                break;
+            case 1:
+                ok = fixedBlock();
+                break;
+            case 2:
+                ok = dynamicBlock();
+                break;
+            default:
+                setError(F("Invalid block type"));
+                ok = false;
+        }
+        if(!ok || _error) {
+            return false;
+        }
+    } while(!last);
+    flushOutput();
+    if(!readTrailer()) {
+        return false;
+    }
+    // read rest of the body, so the connection can be reused
+    drain();
+    return true;
+}
+
+bool GzipInflater::readHeader() {
+    int id1 = nextByte();
+    int id2 = nextByte();
+    int method = nextByte();
+    int flags = nextByte();
+    if(id1 != 0x1f || id2 != 0x8b || method != 8) {
+        setError(F("Invalid gzip header"));
+        return false;
+    }
+    // modification time, extra flags, OS
+    for(uint8_t i = 0; i < 6; i++) {
+        nextByte();
+    }
+    if(flags & GZIP_FLAG_EXTRA) {
+        uint16_t len = nextByte();
+        len |= nextByte() << 8;
+        while(len-- && !_error) {
+            nextByte();
+        }
+    }
+    if(flags & GZIP_FLAG_NAME) {
+        while(nextByte() > 0);
+    }
+    if(flags & GZIP_FLAG_COMMENT) {
+        while(nextByte() > 0);
+    }
+    if(flags & GZIP_FLAG_HCRC) {
+        nextByte();
+        nextByte();
+    }
+    return !_error;
+}
+
+bool GzipInflater::readTrailer() {
+    // trailer starts at byte boundary
+    _bitBuffer = 0;
+    _bitCount = 0;
+    uint32_t crc = 0, size = 0;
+    for(uint8_t i = 0; i < 4; i++) {
+        crc |= (uint32_t)(nextByte() & 0xff) << (i * 8);
+    }
+    for(uint8_t i = 0; i < 4; i++) {
+        size |= (uint32_t)(nextByte() & 0xff) << (i * 8);
+    }
+    if(_error) {
+        return false;
+    }
+    if(crc != _crc || size != _total) {
+        setError(F("Gzip checksum mismatch"));
+        return false;
+    }
+    return true;
+}
+
+bool GzipInflater::storedBlock() {
+    // stored block starts at byte boundary
+    _bitBuffer = 0;
+    _bitCount = 0;
+    uint16_t len = nextByte() & 0xff;
+    len |= (nextByte() & 0xff) << 8;
+    uint16_t nlen = nextByte() & 0xff;
+    nlen |= (nextByte() & 0xff) << 8;
+    if(len != (uint16_t)~nlen) {
+        setError(F("Invalid stored block length"));
+        return false;
+    }
+    while(len-- && !_error) {
+        put(nextByte());
+    }
+    return !_error;
+}
+
+bool GzipInflater::fixedBlock() {
+    uint8_t lengths[288];
+    uint16_t i = 0;
+    for(; i < 144; i++) lengths[i] = 8;
+    for(; i < 256; i++) lengths[i] = 9;
+    for(; i < 280; i++) lengths[i] = 7;
+    for(; i < 288; i++) lengths[i] = 8;
+    construct(_lenCode, lengths, 288);
+    for(i = 0; i < 30; i++) lengths[i] = 5;
+    construct(_distCode, lengths, 30);
+    return codes();
+}
+
+bool GzipInflater::dynamicBlock() {
+    uint8_t lengths[286 + 30];
+    uint16_t nlen = bits(5) + 257;
+    uint16_t ndist = bits(5) + 1;
+    uint8_t ncode = bits(4) + 4;
+    if(nlen > 286 || ndist > 30) {
+        setError(F("Invalid dynamic block header"));
+        return false;
+    }
+    // code lengths for the code length code
+    uint8_t i = 0;
+    for(; i < ncode; i++) {
+        lengths[pgm_read_byte(CodeLengthOrder + i)] = bits(3);
+    }
+    for(; i < 19; i++) {
+        lengths[pgm_read_byte(CodeLengthOrder + i)] = 0;
+    }
+    if(!construct(_lenCode, lengths, 19)) {
+        return false;
+    }
+    // literal/length and distance code lengths
+    uint16_t index = 0;
+    while(index < nlen + ndist) {
+        int symbol = decode(_lenCode);
+        if(symbol < 0) {
+            return false;
+        }
+        if(symbol < 16) {
+            lengths[index++] = symbol;
+        } else {
+            uint8_t len = 0;
+            if(symbol == 16) {
+                if(index == 0) {
+                    setError(F("Invalid code lengths"));
+                    return false;
+                }
+                len = lengths[index - 1];
+                symbol = 3 + bits(2);
+            } else if(symbol == 17) {
+                symbol = 3 + bits(3);
+            } else {
+                symbol = 11 + bits(7);
+            }
+            if(index + symbol > nlen + ndist) {
+                setError(F("Invalid code lengths"));
+                return false;
+            }
+            while(symbol--) {
+                lengths[index++] = len;
+            }
+        }
+    }
+    if(lengths[256] == 0) {
+        setError(F("Missing end of block code"));
+        return false;
+    }
+    if(!construct(_lenCode, lengths, nlen) || !construct(_distCode, lengths + nlen, ndist)) {
+        return false;
+    }
+    return codes();
+}
+
+bool GzipInflater::codes() {
+    int symbol;
+    do {
+        symbol = decode(_lenCode);
+        if(symbol < 0) {
+            return false;
+        }
+        if(symbol < 256) {
+            put(symbol);
+        } else if(symbol > 256) {
+            symbol -= 257;
+            if(symbol >= 29) {
+                setError(F("Invalid length code"));
+                return false;
+            }
+            uint16_t len = pgm_read_word(LengthBase + symbol) + bits(pgm_read_byte(LengthExtra + symbol));
+            symbol = decode(_distCode);
+            if(symbol < 0) {
+                return false;
+            }
+            if(symbol >= 30) {
+                setError(F("Invalid distance code"));
+                return false;
+            }
+            uint16_t dist = pgm_read_word(DistanceBase + symbol) + bits(pgm_read_byte(DistanceExtra + symbol));
+            if(dist > _total) {
+                setError(F("Distance too far back"));
+                return false;
+            }
+            copy(dist, len);
+        }
+        if(_error) {
+            return false;
+        }
+    } while(symbol != 256);
+    return true;
+}
+
+bool GzipInflater::construct(Huffman &h, const uint8_t *lengths, uint16_t n) {
+    memset(h.count, 0, 16 * sizeof(uint16_t));
+    for(uint16_t symbol = 0; symbol < n; symbol++) {
+        h.count[lengths[symbol]]++;
+    }
+    // check for over-subscribed code, incomplete code is accepted and fails when a missing code is decoded
+    int left = 1;
+    for(uint8_t len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= h.count[len];
+        if(left < 0) {
+            setError(F("Invalid Huffman code"));
+            return false;
+        }
+    }
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for(uint8_t len = 1; len < 15; len++) {
+        offsets[len + 1] = offsets[len] + h.count[len];
+    }
+    for(uint16_t symbol = 0; symbol < n; symbol++) {
+        if(lengths[symbol] != 0) {
+            h.symbol[offsets[lengths[symbol]]++] = symbol;
+        }
+    }
+    return true;
+}
+
+int GzipInflater::decode(Huffman &h) {
+    int code = 0, first = 0, index = 0;
+    for(uint8_t len = 1; len < 16; len++) {
+        code |= bits(1);
+        int count = h.count[len];
+        if(code - count < first) {
+            return h.symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+        if(_error) {
+            return -1;
+        }
+    }
+    setError(F("Invalid Huffman code"));
+    return -1;
+}
+
+uint32_t GzipInflater::bits(uint8_t need) {
+    uint32_t val = _bitBuffer;
+    while(_bitCount < need) {
+        int b = nextByte();
+        if(b < 0) {
+            return 0;
+        }
+        val |= (uint32_t)b << _bitCount;
+        _bitCount += 8;
+    }
+    _bitBuffer = val >> need;
+    _bitCount -= need;
+    return val & ((1UL << need) - 1);
+}
+
+int GzipInflater::nextByte() {
+    if(_inputPos == _inputLen && !fill()) {
+        setError(F("Unexpected end of data"));
+        return -1;
+    }
+    return _input[_inputPos++];
+}
+
+bool GzipInflater::fill() {
+    if(_error) {
+        return false;
+    }
+    size_t len = sizeof(_input);
+    if(_chunked) {
+        if(_chunkRemaining == 0 && !readChunkHeader()) {
+            return false;
+        }
+        if(_chunkRemaining < len) {
+            len = _chunkRemaining;
+        }
+    } else if(_remaining >= 0) {
+        if(_remaining == 0) {
+            return false;
+        }
+        if((size_t)_remaining < len) {
+            len = _remaining;
+        }
+    }
+    int read = readRaw(_input, len);
+    if(read <= 0) {
+        return false;
+    }
+    if(_chunked) {
+        _chunkRemaining -= read;
+    } else if(_remaining > 0) {
+        _remaining -= read;
+    }
+    _inputPos = 0;
+    _inputLen = read;
+    return true;
+}
+
+bool GzipInflater::readChunkHeader() {
+    if(_lastChunk) {
+        return false;
+    }
+    int c;
+    if(_chunkStarted) {
+        // CRLF after data of the previous chunk
+        readRawByte();
+        readRawByte();
+    }
+    _chunkStarted = true;
+    uint32_t size = 0;
+    bool digits = true;
+    while((c = readRawByte()) >= 0 && c != '\n') {
+        if(!digits) {
+            // chunk extension
+            continue;
+        }
+        if(c >= '0' && c <= '9') {
+            size = (size << 4) | (c - '0');
+        } else if(c >= 'a' && c <= 'f') {
+            size = (size << 4) | (c - 'a' + 10);
+        } else if(c >= 'A' && c <= 'F') {
+            size = (size << 4) | (c - 'A' + 10);
+        } else {
+            digits = false;
+        }
+    }
+    if(c < 0) {
+        return false;
+    }
+    if(size == 0) {
+        // final CRLF, trailer headers are not expected
+        readRawByte();
+        readRawByte();
+        _lastChunk = true;
+        return false;
+    }
+    _chunkRemaining = size;
+    return true;
+}
+
+int GzipInflater::readRaw(uint8_t *buff, size_t len) {
+    unsigned long start = millis();
+    while(true) {
+        int available = _client->available();
+        if(available > 0) {
+            return _client->read(buff, (size_t)available < len ? available : len);
+        }
+        if(!_client->connected() || millis() - start > _timeout) {
+            return -1;
+        }
+        delay(1);
+    }
+}
+
+int GzipInflater::readRawByte() {
+    uint8_t b;
+    return readRaw(&b, 1) == 1 ? b : -1;
+}
+
+void GzipInflater::drain() {
+    if(_chunked) {
+        do {
+            _inputPos = _inputLen = 0;
+        } while(fill());
+    } else {
+        while(_remaining > 0 && fill());
+    }
+}
+
+void GzipInflater::put(char c) {
+    _output[_outputLen++] = c;
+    uint32_t crc = _crc ^ 0xffffffff ^ (uint8_t)c;
+    crc = (crc >> 4) ^ pgm_read_dword(CrcTable + (crc & 0x0f));
+    crc = (crc >> 4) ^ pgm_read_dword(CrcTable + (crc & 0x0f));
+    _crc = crc ^ 0xffffffff;
+    _total++;
+    if(_outputLen == GZIP_OUTPUT_BUFFER_SIZE) {
+        flushOutput();
+    }
+}
+
+void GzipInflater::copy(uint16_t dist, uint16_t len) {
+    while(len--) {
+        // referenced byte is either still in the output buffer or already in the result
+        char c;
+        if(dist <= _outputLen) {
+            c = _output[_outputLen - dist];
+        } else {
+            c = (*_result)[_result->length() - (dist - _outputLen)];
+        }
+        put(c);
+    }
+}
+
+void GzipInflater::flushOutput() {
+    if(_outputLen > 0) {
+        _output[_outputLen] = 0;
+        _result->concat(_output);
+        _outputLen = 0;
+    }
+    // decoding of a large response can take long, let WiFi stack work and feed watchdog
+    yield();
+}
+
+void GzipInflater::setError(const __FlashStringHelper *error) {
+    // keep the first error, which is the cause
+    if(!_error) {
+        _error = error;
+    }
+}
@@ -0,0 +1,105 @@
+/**
+ *
+ * GzipInflater.h: Streaming gzip decoder for HTTP responses
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 InfluxData
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+#ifndef _GZIP_INFLATER_H_
+#define _GZIP_INFLATER_H_
+
+#include "Arduino.h"
+#include <WiFiClient.h>
+
+// Size of buffer for compressed data read from network
+#define GZIP_INPUT_BUFFER_SIZE 128
+// Size of buffer for decompressed data before it is appended to output
+#define GZIP_OUTPUT_BUFFER_SIZE 128
+
+// Decodes gzip compressed HTTP response body while reading it from a connection.
+// Body can have known length or can use chunked transfer encoding.
+// Decompressed data is appended to output string, which also serves as the window for back references,
+// so only small fixed size input and output buffers are needed.
+class GzipInflater {
+  public:
+    // client - connection with the response body positioned after headers
+    // size - content length or -1 if unknown
+    // chunked - body uses chunked transfer encoding
+    // timeout - max time in ms to wait for data
+    GzipInflater(WiFiClient *client, int size, bool chunked, uint16_t timeout = 5000);
+    // Reads and decodes whole body and appends it to output. Returns false in case of an error, see getError()
+    bool inflate(String &output);
+    // Returns description of the last error
+    String getError() const { return _error ? String(_error) : String(); }
+  protected:
+    // Huffman code: count of codes for each length and symbols ordered by code
+    struct Huffman {
+        uint16_t *count;
+        uint16_t *symbol;
+    };
+    WiFiClient *_client;
+    int _remaining;
+    bool _chunked;
+    uint32_t _chunkRemaining = 0;
+    bool _chunkStarted = false;
+    bool _lastChunk = false;
+    uint16_t _timeout;
+    uint8_t _input[GZIP_INPUT_BUFFER_SIZE];
+    uint8_t _inputPos = 0;
+    uint8_t _inputLen = 0;
+    uint32_t _bitBuffer = 0;
+    uint8_t _bitCount = 0;
+    char _output[GZIP_OUTPUT_BUFFER_SIZE + 1];
+    uint16_t _outputLen = 0;
+    String *_result = nullptr;
+    uint32_t _total = 0;
+    uint32_t _crc = 0;
+    uint16_t _lenCount[16];
+    uint16_t _lenSymbol[288];
+    uint16_t _distCount[16];
+    uint16_t _distSymbol[30];
+    Huffman _lenCode = { _lenCount, _lenSymbol };
+    Huffman _distCode = { _distCount, _distSymbol };
+    const __FlashStringHelper *_error = nullptr;
+
+    bool readHeader();
+    bool readTrailer();
+    bool storedBlock();
+    bool fixedBlock();
+    bool dynamicBlock();
+    bool codes();
+    bool construct(Huffman &h, const uint8_t *lengths, uint16_t n);
+    int decode(Huffman &h);
+    uint32_t bits(uint8_t need);
+    int nextByte();
+    bool fill();
+    bool readChunkHeader();
+    int readRaw(uint8_t *buff, size_t len);
+    int readRawByte();
+    void drain();
+    void put(char c);
+    void copy(uint16_t dist, uint16_t len);
+    void flushOutput();
+    void setError(const __FlashStringHelper *error);
+};
+
+#endif //_GZIP_INFLATER_H_
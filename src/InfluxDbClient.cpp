@@ -25,6 +25,12 @@
  * SOFTWARE.
 */
 #include "InfluxDbClient.h"
+#include "GzipInflater.h"
+#if defined(ESP8266)
+# include <ESP8266WiFi.h>
+#elif defined(ESP32)
+# include <WiFi.h>
+#endif
 
 // Uncomment bellow in case of a problem and rebuild sketch
 //#define INFLUXDB_CLIENT_DEBUG
@@ -35,13 +41,80 @@
 # define INFLUXDB_CLIENT_DEBUG(fmt, ...)
 #endif
 
+// Tracing is enabled in InfluxDbTrace.h
+#ifdef INFLUXDB_CLIENT_TRACE
+# define INFLUXDB_CLIENT_TRACE_BEGIN(phase) _trace.begin(TracePhase::phase)
+# define INFLUXDB_CLIENT_TRACE_END(phase) _trace.end(TracePhase::phase)
+#else
+# define INFLUXDB_CLIENT_TRACE_BEGIN(phase)
+# define INFLUXDB_CLIENT_TRACE_END(phase)
+#endif
+
+#if defined(ESP8266)
+// First 128B of RTC user memory are used by OTA
+# define RTC_BUFFER_OFFSET 32
+# define RTC_BUFFER_SIZE (512 - RTC_BUFFER_OFFSET*4)
+#elif defined(ESP32)
+# define RTC_BUFFER_SIZE INFLUXDB_CLIENT_RTC_BUFFER_SIZE
+# if RTC_BUFFER_SIZE > 0
+// RTC slow memory, preserved during deep sleep
+RTC_DATA_ATTR static uint32_t rtcMemory[RTC_BUFFER_SIZE/4];
+# endif
+#endif
+// Marks valid buffer data in RTC memory
+#define RTC_BUFFER_MAGIC 0x1DB0B0F2
+
+// Header of buffer stored in RTC memory, followed by records, each prefixed by its 2 bytes length
+struct RTCBufferHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint16_t count;
+    uint16_t length;
+};
+
+// First char of a record kept in compact form, see packRecord()
+#define PACKED_RECORD_MARKER '\x01'
+
+// Lowest write rate in percent of the configured limit, when it is lowered after 429 responses
+#define WRITE_RATE_MIN_FACTOR 10
+// Write rate increase in percent after a successful write
+#define WRITE_RATE_STEP 5
+
+// Max decimal places of float samples, double has at most 17 significant digits
+#define SAMPLE_MAX_DECIMAL_PLACES 17
+// Size of buffer for a formatted sample, the largest double has 309 digits before the decimal point, plus sign, point and terminator
+#define SAMPLE_BUFFER_SIZE (309 + SAMPLE_MAX_DECIMAL_PLACES + 3)
+
+// Time in ms after which a failed server is tried again
+#define SERVER_RETRY_INTERVAL 30000
+
 static const char UnitialisedMessage[] PROGMEM = "Unconfigured instance"; 
 // This cannot be put to PROGMEM due to the way how it used
 static const char RetryAfter[] = "Retry-After";
+static const char DateHeader[] = "Date";
+static const char ContentEncoding[] = "Content-Encoding";
+static const char TransferEncoding[] = "Transfer-Encoding";
 
-static String escapeKey(String key);
-static String escapeValue(const char *value);
+// Characters requiring escaping in measurement name
+static const char MeasurementEscapeChars[] = ", ";
+// Characters requiring escaping in tag key, tag value and field key
+static const char KeyEscapeChars[] = ",= ";
+// Characters requiring escaping in string field value
+static const char ValueEscapeChars[] = "\\\"";
+
+static void escapeTo(String &dest, const char *src, const char *escapeChars);
+static char *formatUInt64(char *buff, uint64_t value);
 static String escapeJSONString(String &value);
+static bool rtcRead(uint16_t offset, uint32_t *data, size_t size);
+static bool rtcWrite(uint16_t offset, const uint32_t *data, size_t size);
+static uint32_t checksum(const RTCBufferHeader &header, const uint8_t *data);
+static uint32_t parseHttpDate(const char *date);
+static const char *validateRecord(const char *record);
+static bool isDigit(char c);
+static const char *skipKey(const char *p, bool stopOnEqual);
+static String unescape(const char *begin, const char *end);
+static String escapeFluxString(const String &value);
+static String getCSVField(const String &line, int index);
 
 static String precisionToString(WritePrecision precision) {
     switch(precision) {
@@ -58,41 +131,86 @@ static String precisionToString(WritePrecision precision) {
     }
 }
 
+// Formats timestamp given by seconds since epoch and milliseconds part in the desired precision
+static String formatTimestamp(unsigned long seconds, uint16_t millisPart, WritePrecision precision) {
+    // room for any uint16_t value, padded to nanoseconds
+    char buff[12];
+    String ts(seconds);
+    switch(precision) {
+        case WritePrecision::NS:
+            sprintf(buff, "%03u000000", millisPart);
+            break;
+        case WritePrecision::US:
+            sprintf(buff, "%03u000", millisPart);
+            break;
+        case WritePrecision::MS:
+            sprintf(buff, "%03u", millisPart);
+            break;
+        default:
+            buff[0] = 0;
+            break;
+    }
+    ts += buff;
+    return ts;
+}
+
 Point::Point(String measurement):
-    _measurement(measurement),
     _tags(""),
     _fields(""),
     _timestamp("")
 {
-
+    escapeTo(_measurement, measurement.c_str(), MeasurementEscapeChars);
 }
 
 void Point::addTag(String name, String value) {
     if(_tags.length() > 0) {
         _tags += ',';
     }
-    _tags += escapeKey(name);
+    escapeTo(_tags, name.c_str(), KeyEscapeChars);
     _tags += '=';
-    _tags += escapeKey(value);
+    escapeTo(_tags, value.c_str(), KeyEscapeChars);
 }
 
 void Point::addField(String name, const char *value) { 
-    putField(name, "\"" + escapeValue(value) + "\""); 
+    String quoted;
+    quoted.reserve(strlen(value) + 2);
+    quoted += '"';
+    escapeTo(quoted, value, ValueEscapeChars);
+    quoted += '"';
+    putField(name, quoted); 
 }
 
 void Point::putField(String name, String value) {
     if(_fields.length() > 0) {
         _fields += ',';
     }
-    _fields += escapeKey(name);
+    escapeTo(_fields, name.c_str(), KeyEscapeChars);
     _fields += '=';
     _fields += value;
 }
 
+String Point::createSeriesKey() const {
+    String key = _measurement;
+    if(hasTags()) {
+        key += ',';
+        key += _tags;
+    }
+    return key;
+}
+
 String Point::toLineProtocol() const {
-    String line =  _measurement + "," + _tags + " " + _fields;
-    if(_timestamp != "") {
-        line += " " + _timestamp;
+    String line;
+    line.reserve(_measurement.length() + 1 + _tags.length() + 1 + _fields.length() + 1 + _timestamp.length());
+    line += _measurement;
+    if(hasTags()) {
+        line += ',';
+        line += _tags;
+    }
+    line += ' ';
+    line += _fields;
+    if(hasTime()) {
+        line += ' ';
+        line += _timestamp;
     }
     return line;
 }
@@ -140,6 +258,7 @@ void Point:: clearTags() {
 
 InfluxDBClient::InfluxDBClient() { 
     _pointsBuffer = new String[_bufferSize];
+    _linesBuffer = new uint16_t[_bufferSize];
 }
 
 InfluxDBClient::InfluxDBClient(const char *serverUrl, const char *org, const char *bucket, const char *authToken):InfluxDBClient(serverUrl, org, bucket, authToken, nullptr) { 
@@ -152,6 +271,12 @@ InfluxDBClient::InfluxDBClient(const char *serverUrl, const char *org, const cha
 void InfluxDBClient::setConnectionParams(const char *serverUrl, const char *org, const char *bucket, const char *authToken, const char *certInfo) {
     clean();
     _serverUrl = serverUrl;
+    for(uint8_t i = 0; i < INFLUXDB_CLIENT_MAX_SERVERS; i++) {
+        _servers[i] = ServerEndpoint();
+    }
+    _servers[0].url = serverUrl;
+    _serversCount = 1;
+    _currentServer = 0;
     _bucket = bucket;
     _org = org;
     _authToken = authToken;
@@ -166,6 +291,7 @@ bool InfluxDBClient::init() {
     }
     if(_serverUrl.endsWith("/")) {
         _serverUrl = _serverUrl.substring(0,_serverUrl.length()-1);
+        _servers[_currentServer].url = _serverUrl;
     }
     setUrls();
     bool https = _serverUrl.startsWith("https");
@@ -190,7 +316,7 @@ bool InfluxDBClient::init() {
     } else {
         _wifiClient = new WiFiClient;
     }
-    _httpClient.setReuse(false);
+    _httpClient.setReuse(_preserveConnection);
     return true;
 }
 
@@ -198,10 +324,17 @@ InfluxDBClient::~InfluxDBClient() {
      if(_pointsBuffer) {
         delete [] _pointsBuffer;
         _pointsBuffer = nullptr;
+        delete [] _linesBuffer;
+        _linesBuffer = nullptr;
         _bufferPointer = 0;
         _batchPointer = 0;
         _bufferCeiling = 0;
     }
+    setLastValueCache(0);
+    if(_seriesKeys) {
+        delete [] _seriesKeys;
+        _seriesKeys = nullptr;
+    }
     clean();
 }
 
@@ -218,14 +351,162 @@ void InfluxDBClient::clean() {
     _lastFlushed = 0;
     _lastRequestTime = 0;
     _lastRetryAfter = 0;
+    _serverIP = IPAddress();
+    _serverIPTime = 0;
+    // server time offset is valid only for the server it was taken from
+    _serverTime = 0;
+    _serverTimeMillis = 0;
 }
 
 void InfluxDBClient::setUrls() {
-    _writeUrl = _serverUrl + "/api/v2/write?org=" + _org + "&bucket=" + _bucket;
+    String url = _serverUrl;
+    if(uint32_t(_serverIP) != 0) {
+        // connect directly to the cached address
+        int start = url.indexOf("://");
+        start = start < 0 ? 0 : start + 3;
+        url = url.substring(0, start) + _serverIP.toString() + url.substring(start + getServerHost().length());
+    }
+    _writeUrl = url + "/api/v2/write?org=" + _org + "&bucket=" + _bucket;
     if(_writePrecision != WritePrecision::NoTime) {
         _writeUrl += String("&precision=") + precisionToString(_writePrecision);
     }
-    _queryUrl = _serverUrl + "/api/v2/query?org=" + _org;
+    _queryUrl = url + "/api/v2/query?org=" + _org;
+    _readyUrl = url + "/ready";
+}
+
+String InfluxDBClient::getServerHost() const {
+    int start = _serverUrl.indexOf("://");
+    start = start < 0 ? 0 : start + 3;
+    int end = start;
+    while(end < (int)_serverUrl.length() && _serverUrl[end] != ':' && _serverUrl[end] != '/') {
+        end++;
+    }
+    return _serverUrl.substring(start, end);
+}
+
+void InfluxDBClient::setDNSCacheTTL(uint32_t ttl) {
+    _dnsCacheTTL = ttl;
+    if(!_dnsCacheTTL && uint32_t(_serverIP) != 0) {
+        _serverIP = IPAddress();
+        setUrls();
+    }
+}
+
+void InfluxDBClient::resolveServer() {
+    if(!_dnsCacheTTL || _serverUrl.startsWith("https")) {
+        return;
+    }
+    if(uint32_t(_serverIP) != 0 && (millis() - _serverIPTime)/1000 < _dnsCacheTTL) {
+        return;
+    }
+    String host = getServerHost();
+    IPAddress ip;
+    if(ip.fromString(host)) {
+        // already an address
+        return;
+    }
+    INFLUXDB_CLIENT_TRACE_BEGIN(DNS);
+    int resolved = WiFi.hostByName(host.c_str(), ip);
+    INFLUXDB_CLIENT_TRACE_END(DNS);
+    if(resolved == 1) {
+        INFLUXDB_CLIENT_DEBUG("[D] Resolved %s to %s\n", host.c_str(), ip.toString().c_str());
+        _serverIPTime = millis();
+    } else {
+        INFLUXDB_CLIENT_DEBUG("[E] Failed to resolve %s\n", host.c_str());
+        ip = IPAddress();
+    }
+    _serverIP = ip;
+    setUrls();
+}
+
+bool InfluxDBClient::addServerUrl(const char *serverUrl) {
+    String url = serverUrl;
+    if(_serversCount == 0 || _serversCount == INFLUXDB_CLIENT_MAX_SERVERS || url.indexOf("://") < 0 
+        || url.startsWith("https") != _servers[0].url.startsWith("https")) {
+        return false;
+    }
+    if(url.endsWith("/")) {
+        url = url.substring(0, url.length()-1);
+    }
+    _servers[_serversCount++].url = url;
+    return true;
+}
+
+bool InfluxDBClient::isServerHealthy(uint8_t index) const {
+    return _servers[index].failures == 0 || millis() - _servers[index].lastFailure > SERVER_RETRY_INTERVAL;
+}
+
+bool InfluxDBClient::hasHealthyServer() const {
+    for(uint8_t i = 0; i < _serversCount; i++) {
+        if(i != _currentServer && isServerHealthy(i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void InfluxDBClient::selectServer() {
+    if(_serversCount < 2) {
+        return;
+    }
+    uint8_t best = _currentServer;
+    bool bestHealthy = isServerHealthy(best);
+    for(uint8_t i = 0; i < _serversCount; i++) {
+        if(i == best || !isServerHealthy(i)) {
+            continue;
+        }
+        // switch from healthy server only if the other is significantly faster or not measured yet
+        if(!bestHealthy || _servers[i].latency < _servers[best].latency*3/4) {
+            best = i;
+            bestHealthy = true;
+        }
+    }
+    if(!bestHealthy) {
+        // all servers failed, try the next one 
+        best = (_currentServer + 1) % _serversCount;
+    }
+    if(best != _currentServer) {
+        INFLUXDB_CLIENT_DEBUG("[D] Switching server from %s to %s\n", _serverUrl.c_str(), _servers[best].url.c_str());
+        _currentServer = best;
+        _serverUrl = _servers[best].url;
+        _serverIP = IPAddress();
+        // clock of the other server can differ, sync it again from its response
+        _serverTime = 0;
+        _serverTimeMillis = 0;
+        setUrls();
+        if(_wifiClient) {
+            // don't reuse connection to previous server
+            _wifiClient->stop();
+        }
+    }
+}
+
+void InfluxDBClient::updateServerHealth(uint32_t duration) {
+    ServerEndpoint &server = _servers[_currentServer];
+    if(_lastStatusCode < 0 || _lastStatusCode == 502 || _lastStatusCode == 503 || _lastStatusCode == 504) {
+        server.failures++;
+        server.lastFailure = millis();
+    } else {
+        server.failures = 0;
+        if(duration) {
+            server.latency = server.latency ? (3*server.latency + duration)/4 : duration;
+        }
+    }
+}
+
+bool InfluxDBClient::warmup() {
+    if(!_wifiClient && !init()) {
+        _lastStatusCode = 0;
+        _lastErrorResponse = FPSTR(UnitialisedMessage);
+        return false;
+    }
+    if(!_dnsCacheTTL || _serverUrl.startsWith("https")) {
+        // resolve at least into the system DNS cache
+        IPAddress ip;
+        String host = getServerHost();
+        WiFi.hostByName(host.c_str(), ip);
+    }
+    return validateConnection();
 }
 
 void InfluxDBClient::setWriteOptions(WritePrecision precision, uint16_t batchSize, uint16_t bufferSize, uint16_t flushInterval, bool preserveConnection) {
@@ -246,35 +527,326 @@ void InfluxDBClient::setWriteOptions(WritePrecision precision, uint16_t batchSiz
             _bufferSize = 2*_batchSize;
             INFLUXDB_CLIENT_DEBUG("[D] Changing buffer size to %d\n", _bufferSize);
         }
-        resetBuffer();
+        clearBuffer();
+        if(_rtcBuffer) {
+            // points are still kept in RTC memory 
+            restoreRTCBuffer();
+        }
     }
     _flushInterval = flushInterval;
+    _preserveConnection = preserveConnection;
     _httpClient.setReuse(preserveConnection);
 }
 
 void InfluxDBClient::resetBuffer() {
+    clearBuffer();
+    if(_rtcBuffer) {
+        saveRTCBuffer();
+    }
+}
+
+void InfluxDBClient::clearBuffer() {
     if(_pointsBuffer) {
         delete [] _pointsBuffer;
+        delete [] _linesBuffer;
     }
     _pointsBuffer = new String[_bufferSize];
+    _linesBuffer = new uint16_t[_bufferSize];
     _bufferPointer = 0;
     _batchPointer = 0;
     _bufferCeiling = 0;
+    _seriesCount = 0;
+}
+
+void InfluxDBClient::setRTCBuffer(bool enable) {
+    _rtcBuffer = enable;
+    if(_rtcBuffer && isBufferEmpty()) {
+        restoreRTCBuffer();
+    }
 }
 
 bool InfluxDBClient::writePoint(Point & point) {
     if (point.hasFields()) {
         if(_writePrecision != WritePrecision::NoTime && !point.hasTime()) {
-            point.setTime(_writePrecision);
+            if(_useServerTime && _serverTime > 0) {
+                uint32_t elapsed = millis() - _serverTimeMillis;
+                point.setTime(formatTimestamp(_serverTime + elapsed/1000, elapsed%1000, _writePrecision));
+            } else {
+                point.setTime(_writePrecision);
+            }
+        }
+        if(_lastValues) {
+            cacheLastValues(point);
         }
-        String line = point.toLineProtocol();
-        return writeRecord(line);
+        INFLUXDB_CLIENT_TRACE_BEGIN(Serialize);
+        String line;
+        if(!_seriesKeys || !packRecord(point, line)) {
+            line = point.toLineProtocol();
+        }
+        INFLUXDB_CLIENT_TRACE_END(Serialize);
+        return bufferRecord(line);
     }
     return false;
 }
 
+void InfluxDBClient::setDeferredSerialization(uint8_t maxSeries) {
+    if(_seriesKeys) {
+        // convert records referring to the current series table to line protocol
+        for(uint16_t i = 0; i < _bufferCeiling; i++) {
+            if(_pointsBuffer[i][0] == PACKED_RECORD_MARKER) {
+                uint16_t len = recordLength(_pointsBuffer[i]);
+                char *line = new char[len + 1];
+                line[copyRecord(line, _pointsBuffer[i])] = 0;
+                _pointsBuffer[i] = line;
+                delete [] line;
+            }
+        }
+        delete [] _seriesKeys;
+        _seriesKeys = nullptr;
+    }
+    // series index is stored as a single non-zero char
+    _seriesKeysSize = maxSeries < 254 ? maxSeries : 254;
+    _seriesCount = 0;
+    if(_seriesKeysSize) {
+        _seriesKeys = new String[_seriesKeysSize];
+    }
+}
+
+int InfluxDBClient::internSeries(Point &point) {
+    uint16_t measurementLen = point._measurement.length();
+    uint16_t len = measurementLen + (point.hasTags() ? 1 + point._tags.length() : 0);
+    for(uint8_t i = 0; i < _seriesCount; i++) {
+        const String &key = _seriesKeys[i];
+        if(key.length() == len && !memcmp(key.c_str(), point._measurement.c_str(), measurementLen)
+            && (!point.hasTags() || !memcmp(key.c_str() + measurementLen + 1, point._tags.c_str(), point._tags.length()))) {
+            return i;
+        }
+    }
+    if(_seriesCount == _seriesKeysSize) {
+        return -1;
+    }
+    _seriesKeys[_seriesCount] = point.createSeriesKey();
+    return _seriesCount++;
+}
+
+bool InfluxDBClient::packRecord(Point &point, String &record) {
+    const char *ts = point._timestamp.c_str();
+    uint8_t digits = point._timestamp.length();
+    if(point._timestamp.length() > 20) {
+        return false;
+    }
+    for(uint8_t i = 0; i < digits; i++) {
+        if(!isDigit(ts[i])) {
+            return false;
+        }
+    }
+    int series = internSeries(point);
+    if(series < 0) {
+        INFLUXDB_CLIENT_DEBUG("[D] Series table full, keeping point as line protocol\n");
+        return false;
+    }
+    // marker, series index + 1, count of timestamp digits + 1, two timestamp digits + 1 per char, fields.
+    // All chars are non-zero, so record can be kept in String
+    record.reserve(3 + (digits + 1)/2 + point._fields.length());
+    record += PACKED_RECORD_MARKER;
+    record += (char)(series + 1);
+    record += (char)(digits + 1);
+    for(uint8_t i = 0; i < digits; i += 2) {
+        uint8_t packed = (ts[i] - '0' + 1) << 4;
+        if(i + 1 < digits) {
+            packed |= ts[i + 1] - '0' + 1;
+        }
+        record += (char)packed;
+    }
+    record += point._fields;
+    return true;
+}
+
+uint16_t InfluxDBClient::recordLength(const String &record) const {
+    const char *p = record.c_str();
+    if(*p != PACKED_RECORD_MARKER) {
+        return record.length();
+    }
+    uint8_t digits = (uint8_t)p[2] - 1;
+    uint16_t header = 3 + (digits + 1)/2;
+    return _seriesKeys[(uint8_t)p[1] - 1].length() + 1 + record.length() - header + (digits ? 1 + digits : 0);
+}
+
+uint16_t InfluxDBClient::copyRecord(char *dest, const String &record) const {
+    const char *p = record.c_str();
+    if(*p != PACKED_RECORD_MARKER) {
+        memcpy(dest, p, record.length());
+        return record.length();
+    }
+    const String &key = _seriesKeys[(uint8_t)p[1] - 1];
+    uint8_t digits = (uint8_t)p[2] - 1;
+    uint16_t header = 3 + (digits + 1)/2;
+    char *d = dest;
+    memcpy(d, key.c_str(), key.length());
+    d += key.length();
+    *d++ = ' ';
+    memcpy(d, p + header, record.length() - header);
+    d += record.length() - header;
+    if(digits) {
+        *d++ = ' ';
+        for(uint8_t i = 0; i < digits; i++) {
+            uint8_t packed = p[3 + i/2];
+            *d++ = '0' + (i % 2 ? packed & 0x0f : packed >> 4) - 1;
+        }
+    }
+    return d - dest;
+}
+
+bool InfluxDBClient::writeSamples(Point &series, const char *field, const float *values, const uint64_t *timestamps, uint16_t count, int decimalPlaces) {
+    return bufferSamples(series, field, SampleType::Float, values, timestamps, count, decimalPlaces);
+}
+
+bool InfluxDBClient::writeSamples(Point &series, const char *field, const double *values, const uint64_t *timestamps, uint16_t count, int decimalPlaces) {
+    return bufferSamples(series, field, SampleType::Double, values, timestamps, count, decimalPlaces);
+}
+
+bool InfluxDBClient::writeSamples(Point &series, const char *field, const int *values, const uint64_t *timestamps, uint16_t count) {
+    return bufferSamples(series, field, SampleType::Int, values, timestamps, count, 0);
+}
+
+bool InfluxDBClient::writeSamples(Point &series, const char *field, const long *values, const uint64_t *timestamps, uint16_t count) {
+    return bufferSamples(series, field, SampleType::Long, values, timestamps, count, 0);
+}
+
+bool InfluxDBClient::writeSamples(Point &series, const char *field, const bool *values, const uint64_t *timestamps, uint16_t count) {
+    return bufferSamples(series, field, SampleType::Bool, values, timestamps, count, 0);
+}
+
+bool InfluxDBClient::bufferSamples(Point &series, const char *field, SampleType type, const void *values, const uint64_t *timestamps, uint16_t count, int decimalPlaces) {
+    if(!field || !*field || !values) {
+        return false;
+    }
+    bool integer = type == SampleType::Int || type == SampleType::Long;
+    // series key and field key are the same for all lines
+    String prefix = series.createSeriesKey();
+    prefix += ' ';
+    escapeTo(prefix, field, KeyEscapeChars);
+    prefix += '=';
+    INFLUXDB_CLIENT_TRACE_BEGIN(Serialize);
+    String record;
+    char buff[SAMPLE_BUFFER_SIZE];
+    int last = -1;
+    uint16_t lines = 0;
+    bool ret = true;
+    for(uint16_t i = 0; i < count; i++) {
+        if(!formatSample(buff, type, values, i, decimalPlaces)) {
+            continue;
+        }
+        if(lines == 0) {
+            record = "";
+            record.reserve((count - i < _batchSize ? count - i : _batchSize) * (prefix.length() + 34));
+        } else {
+            record += '\n';
+        }
+        record += prefix;
+        record += buff;
+        if(integer) {
+            record += 'i';
+        }
+        if(timestamps) {
+            record += ' ';
+            record += formatUInt64(buff, timestamps[i]);
+        }
+        last = i;
+        // record has at most batch size lines, so a failed batch can be split and the record fits into RTC memory
+        if(++lines == _batchSize) {
+            INFLUXDB_CLIENT_TRACE_END(Serialize);
+            ret = bufferRecord(record) && ret;
+            INFLUXDB_CLIENT_TRACE_BEGIN(Serialize);
+            lines = 0;
+        }
+        yield();
+    }
+    INFLUXDB_CLIENT_TRACE_END(Serialize);
+    if(last < 0) {
+        return false;
+    }
+    if(lines) {
+        ret = bufferRecord(record) && ret;
+    }
+    if(_lastValues) {
+        String key = series.createSeriesKey();
+        key += ' ';
+        key += field;
+        formatSample(buff, type, values, last, decimalPlaces);
+        getCachedValue(key, true)->value = buff;
+    }
+    return ret;
+}
+
+bool InfluxDBClient::formatSample(char *buff, SampleType type, const void *values, uint16_t index, int decimalPlaces) {
+    // keep the formatted value within SAMPLE_BUFFER_SIZE
+    decimalPlaces = decimalPlaces < 0 ? 0 : (decimalPlaces > SAMPLE_MAX_DECIMAL_PLACES ? SAMPLE_MAX_DECIMAL_PLACES : decimalPlaces);
+    switch(type) {
+        case SampleType::Float: {
+            float value = ((const float *)values)[index];
+            if(isnan(value)) {
+                return false;
+            }
+            dtostrf(value, 1, decimalPlaces, buff);
+        } break;
+        case SampleType::Double: {
+            double value = ((const double *)values)[index];
+            if(isnan(value)) {
+                return false;
+            }
+            dtostrf(value, 1, decimalPlaces, buff);
+        } break;
+        case SampleType::Int:
+            ltoa(((const int *)values)[index], buff, 10);
+            break;
+        case SampleType::Long:
+            ltoa(((const long *)values)[index], buff, 10);
+            break;
+        default:
+            strcpy(buff, ((const bool *)values)[index] ? "true" : "false");
+    }
+    return true;
+}
+
 bool InfluxDBClient::writeRecord(String &record) {
+    const char *error = validateRecord(record.c_str());
+    if(error) {
+        INFLUXDB_CLIENT_DEBUG("[E] Invalid record '%s': %s\n", record.c_str(), error);
+        _lastStatusCode = 0;
+        _lastErrorResponse = String("Invalid record: ") + error;
+        return false;
+    }
+    int len = record.length();
+    if(len > 0 && (record[len-1] == '\n' || record[len-1] == '\r')) {
+        // strip trailing new line, lines are separated when a batch is created
+        String normalized = record;
+        while(len > 0 && (normalized[len-1] == '\n' || normalized[len-1] == '\r')) {
+            --len;
+        }
+        normalized.remove(len);
+        return bufferRecord(normalized);
+    }
+    return bufferRecord(record);
+}
+
+bool InfluxDBClient::bufferRecord(String &record) {
+    addToBuffer(record);
+    bool ret = checkBuffer();
+    if(_rtcBuffer) {
+        saveRTCBuffer();
+    }
+    return ret;
+}
+
+void InfluxDBClient::addToBuffer(String &record) {
     _pointsBuffer[_bufferPointer] = record;
+    // records from writeRecord() and writeSamples() can have more lines, they count to batch size by lines
+    uint16_t lines = 1;
+    for(const char *p = strchr(record.c_str(), '\n'); p; p = strchr(p + 1, '\n')) {
+        lines++;
+    }
+    _linesBuffer[_bufferPointer] = lines;
     _bufferPointer++;
     if(_bufferPointer == _bufferSize) {
         _bufferPointer = 0;
@@ -291,12 +863,235 @@ bool InfluxDBClient::writeRecord(String &record) {
         // When we are overwriting buffer and nothing is written, batchPointer must point to the oldest point
         _batchPointer = _bufferPointer;
     }
-    return checkBuffer();
+}
+
+uint16_t InfluxDBClient::pendingCount() const {
+    if(isBufferEmpty()) {
+        return 0;
+    }
+    if(isBufferFull() && _batchPointer == _bufferPointer) {
+        return _bufferSize;
+    }
+    return (_bufferPointer + _bufferSize - _batchPointer) % _bufferSize;
+}
+
+uint16_t InfluxDBClient::pendingLines(uint16_t limit) const {
+    uint16_t count = pendingCount();
+    uint16_t lines = 0;
+    uint16_t i = _batchPointer;
+    for(uint16_t c = 0; c < count && lines < limit; c++) {
+        lines += _linesBuffer[i++];
+        if(i == _bufferSize) {
+            i = 0;
+        }
+    }
+    return lines;
+}
+
+bool InfluxDBClient::saveRTCBuffer() {
+    RTCBufferHeader header;
+    header.magic = RTC_BUFFER_MAGIC;
+    header.count = 0;
+    header.length = 0;
+    uint16_t count = pendingCount();
+    // take as many newest records as fit
+    while(header.count < count) {
+        uint16_t i = (_bufferPointer + _bufferSize - 1 - header.count) % _bufferSize;
+        uint16_t len = recordLength(_pointsBuffer[i]) + 2;
+        if(sizeof(RTCBufferHeader) + header.length + len > RTC_BUFFER_SIZE) {
+            INFLUXDB_CLIENT_DEBUG("[W] RTC buffer full, storing only %d of %d points\n", header.count, count);
+            break;
+        }
+        header.length += len;
+        header.count++;
+    }
+    uint32_t *data = nullptr;
+    if(header.length) {
+        data = new uint32_t[(header.length + 3)/4];
+        char *p = (char *)data;
+        uint16_t i = (_bufferPointer + _bufferSize - header.count) % _bufferSize;
+        for(uint16_t c = 0; c < header.count; c++) {
+            // record can have more lines, so length is stored instead of separator
+            uint16_t len = copyRecord(p + 2, _pointsBuffer[i]);
+            p[0] = len & 0xFF;
+            p[1] = len >> 8;
+            p += 2 + len;
+            if(++i == _bufferSize) {
+                i = 0;
+            }
+        }
+    }
+    header.checksum = checksum(header, (uint8_t *)data);
+    bool res = true;
+    if(data) {
+        res = rtcWrite(sizeof(RTCBufferHeader)/4, data, (header.length + 3) & ~3);
+        delete [] data;
+    }
+    res = res && rtcWrite(0, (uint32_t *)&header, sizeof(RTCBufferHeader));
+    return res && header.count == count;
+}
+
+void InfluxDBClient::restoreRTCBuffer() {
+    RTCBufferHeader header;
+    if(!rtcRead(0, (uint32_t *)&header, sizeof(RTCBufferHeader)) || header.magic != RTC_BUFFER_MAGIC 
+        || header.count == 0 || sizeof(RTCBufferHeader) + header.length > RTC_BUFFER_SIZE) {
+        return;
+    }
+    // one more byte for terminating the last record
+    uint32_t *data = new uint32_t[(header.length + 4)/4];
+    if(rtcRead(sizeof(RTCBufferHeader)/4, data, (header.length + 3) & ~3) && checksum(header, (uint8_t *)data) == header.checksum) {
+        char *p = (char *)data;
+        char *end = p + header.length;
+        uint16_t count = 0;
+        while(p + 2 <= end) {
+            uint16_t len = (uint8_t)p[0] | ((uint8_t)p[1] << 8);
+            p += 2;
+            if(p + len > end) {
+                break;
+            }
+            // terminate record temporarily, the next byte is length of the following record
+            char next = p[len];
+            p[len] = 0;
+            String record = p;
+            p[len] = next;
+            addToBuffer(record);
+            p += len;
+            count++;
+        }
+        INFLUXDB_CLIENT_DEBUG("[D] Restored %d of %d points from RTC memory\n", count, header.count);
+    } else {
+        INFLUXDB_CLIENT_DEBUG("[E] Invalid RTC buffer data\n");
+    }
+    delete [] data;
+}
+
+void InfluxDBClient::setLastValueCache(uint8_t maxValues) {
+    if(_lastValues) {
+        delete [] _lastValues;
+        _lastValues = nullptr;
+    }
+    _lastValuesSize = maxValues;
+    if(_lastValuesSize) {
+        _lastValues = new LastValue[_lastValuesSize];
+        for(uint8_t i = 0; i < _lastValuesSize; i++) {
+            _lastValues[i].lastUsed = 0;
+        }
+    }
+}
+
+InfluxDBClient::LastValue *InfluxDBClient::getCachedValue(const String &key, bool create) {
+    LastValue *leastUsed = _lastValues;
+    for(uint8_t i = 0; i < _lastValuesSize; i++) {
+        if(_lastValues[i].lastUsed && _lastValues[i].key == key) {
+            _lastValues[i].lastUsed = ++_lastValueClock;
+            return _lastValues + i;
+        }
+        if(_lastValues[i].lastUsed < leastUsed->lastUsed) {
+            leastUsed = _lastValues + i;
+        }
+    }
+    if(!create) {
+        return nullptr;
+    }
+    leastUsed->key = key;
+    leastUsed->lastUsed = ++_lastValueClock;
+    return leastUsed;
+}
+
+void InfluxDBClient::cacheLastValues(Point &point) {
+    String series = point.createSeriesKey();
+    const char *p = point._fields.c_str();
+    while(*p) {
+        const char *name = p;
+        p = skipKey(p, true);
+        String key = series;
+        key += ' ';
+        key += unescape(name, p);
+        const char *value = ++p;
+        String decoded;
+        if(*value == '"') {
+            for(p++; *p && *p != '"'; p++) {
+                if(*p == '\\' && p[1]) {
+                    p++;
+                }
+            }
+            decoded = unescape(value + 1, p);
+            p++;
+        } else {
+            while(*p && *p != ',') {
+                p++;
+            }
+            // strip integer type suffix
+            decoded = unescape(value, p[-1] == 'i' || p[-1] == 'u' ? p - 1 : p);
+        }
+        getCachedValue(key, true)->value = decoded;
+        if(*p == ',') {
+            p++;
+        }
+    }
+}
+
+String InfluxDBClient::getLastValue(Point &series, String field) {
+    String key = series.createSeriesKey();
+    key += ' ';
+    key += field;
+    if(_lastValues) {
+        LastValue *cached = getCachedValue(key, false);
+        if(cached) {
+            return cached->value;
+        }
+    }
+    // query last value of field from server
+    const char *p = series._measurement.c_str();
+    const char *end = skipKey(p, false);
+    String fluxQuery = "from(bucket: \"" + escapeFluxString(_bucket) + "\") |> range(start: 0) |> filter(fn: (r) => r._measurement == \"" 
+        + escapeFluxString(unescape(p, end)) + "\"";
+    p = series._tags.c_str();
+    while(*p) {
+        end = skipKey(p, true);
+        fluxQuery += " and r[\"" + escapeFluxString(unescape(p, end)) + "\"] == \"";
+        p = end + 1;
+        end = skipKey(p, false);
+        fluxQuery += escapeFluxString(unescape(p, end)) + "\"";
+        p = *end ? end + 1 : end;
+    }
+    fluxQuery += " and r._field == \"" + escapeFluxString(field) + "\") |> last()";
+    String result = query(fluxQuery);
+    // find _value column in header and take value from the first row
+    int rowStart = result.indexOf('\n');
+    if(rowStart < 0) {
+        return "";
+    }
+    String header = result.substring(0, rowStart);
+    header.trim();
+    int column = -1;
+    int columns = 1;
+    for(unsigned int i = 0; i < header.length(); i++) {
+        if(header[i] == ',') {
+            columns++;
+        }
+    }
+    for(int i = 0; i < columns && column < 0; i++) {
+        if(getCSVField(header, i) == "_value") {
+            column = i;
+        }
+    }
+    if(column < 0) {
+        return "";
+    }
+    int rowEnd = result.indexOf('\n', rowStart + 1);
+    String row = rowEnd < 0 ? result.substring(rowStart + 1) : result.substring(rowStart + 1, rowEnd);
+    row.trim();
+    String value = getCSVField(row, column);
+    if(_lastValues && value.length()) {
+        getCachedValue(key, true)->value = value;
+    }
+    return value;
 }
 
 bool InfluxDBClient::checkBuffer() {
     // in case we (over)reach batchSize with non full buffer
-    bool bufferReachedBatchsize = !isBufferFull() && _bufferPointer - _batchPointer >= _batchSize;
+    bool bufferReachedBatchsize = !isBufferFull() && pendingLines(_batchSize) >= _batchSize;
     // or flush interval timed out
     bool flushTimeout = _flushInterval > 0 && _lastFlushed > 0 && (millis()/1000 - _lastFlushed) > _flushInterval; 
 
@@ -314,17 +1109,80 @@ bool InfluxDBClient::flushBuffer() {
     }
     char *data;
     int size;
+    int lines;
     bool success = true;
+    // Number of lines to send at once, lowered when server rejects a batch
+    uint16_t batchSize = _batchSize;
+    // Number of records not yet written from the range rejected by server, which is being split
+    uint16_t splitRemaining = 0;
+    // Status and error of last rejected record
+    int rejectedStatusCode = 0;
+    String rejectedError;
     // send all batches, It could happen there was long network outage and buffer is full
-    while(data = prepareBatch(size)) {
-        INFLUXDB_CLIENT_DEBUG("[D] Writing batch, size %d\n", size);
+    while(true) {
+        if(!hasWriteTokens()) {
+            // check before preparing batch, so it isn't created in vain on each write
+            if(pendingCount()) {
+                INFLUXDB_CLIENT_DEBUG("[D] Write rate limit reached, leaving data in buffer\n");
+                success = false;
+            }
+            break;
+        }
+        // batch size limits lines, so it limits records as well
+        data = prepareBatch(size, lines, batchSize, splitRemaining ? splitRemaining : _batchSize);
+        if(!data) {
+            if(size) {
+                // data stay in buffer, so it is a failure
+                _lastStatusCode = 0;
+                _lastErrorResponse = F("Not enough memory for batch");
+                INFLUXDB_CLIENT_DEBUG("[E] %s of %d lines\n", _lastErrorResponse.c_str(), lines);
+                success = false;
+            }
+            break;
+        }
+        INFLUXDB_CLIENT_DEBUG("[D] Writing batch, size %d, lines %d\n", size, lines);
+        if(!acquireWriteTokens(strlen(data))) {
+            INFLUXDB_CLIENT_DEBUG("[D] Write rate limit reached, leaving data in buffer\n");
+            delete [] data;
+            success = false;
+            break;
+        }
         int statusCode = postData(data);
+        updateWriteRate(statusCode);
         delete [] data;
+        if((statusCode == 400 || statusCode == 413) && size > 1) {
+            // Bad request can be caused by a single invalid line and too large request by batch size.
+            // Send smaller parts, so only invalid lines are rejected.
+            if(!splitRemaining) {
+                splitRemaining = size;
+            }
+            batchSize = lines/2;
+            INFLUXDB_CLIENT_DEBUG("[D] Batch rejected with %d, splitting to %d\n", statusCode, batchSize);
+            continue;
+        }
         // retry on unsuccessfull connection or retryable status codes
         bool retry = statusCode < 0 || statusCode == 429 || statusCode == 503;
+        // bad gateway or gateway timeout means server is unavailable as well, when there is another server, data is written there
+        retry = retry || ((statusCode == 502 || statusCode == 504) && hasHealthyServer());
         success = statusCode == 204;
         // advance even on message failure (4xx != 429) or server failure (5xx != 503) 
         if(success || !retry) {
+            if(!success) {
+                _rejectedCount += size;
+                rejectedStatusCode = statusCode;
+                rejectedError = _lastErrorResponse;
+                INFLUXDB_CLIENT_DEBUG("[D] Rejected %d records\n", size);
+            }
+            if(splitRemaining) {
+                // continue splitting within the rejected range only, after it is done continue with full batch
+                splitRemaining -= size;
+                if(!splitRemaining) {
+                    batchSize = _batchSize;
+                } else if(success) {
+                    // following records are likely valid as well, try bigger part
+                    batchSize = batchSize*2 < _batchSize ? batchSize*2 : _batchSize;
+                }
+            }
             _lastFlushed = millis()/1000;
             _batchPointer += size;
             //did we got over top?
@@ -335,6 +1193,10 @@ bool InfluxDBClient::flushBuffer() {
                 _bufferCeiling = _bufferPointer;
             }
         } else {
+            if(statusCode != 429 && hasHealthyServer()) {
+                // fail over to other server right away
+                continue;
+            }
             INFLUXDB_CLIENT_DEBUG("[D] Leaving data in buffer for retry\n");
             // in case of retryable failure break loop
             break;
@@ -347,17 +1209,116 @@ bool InfluxDBClient::flushBuffer() {
             _bufferPointer = 0;
             _batchPointer = 0;
             _bufferCeiling = 0;
+            // no record refers to series table
+            _seriesCount = 0;
             INFLUXDB_CLIENT_DEBUG("[D] Buffer empty\n");
         }
     }
+    if(_rtcBuffer) {
+        saveRTCBuffer();
+    }
+    if(rejectedStatusCode) {
+        // report rejection, even if the following batches were written
+        _lastStatusCode = rejectedStatusCode;
+        _lastErrorResponse = rejectedError;
+        return false;
+    }
     return success;
 }
 
-char *InfluxDBClient::prepareBatch(int &size) {
+void InfluxDBClient::setWriteRateLimit(uint32_t bytes, uint16_t requests, uint16_t interval) {
+    _rateBytes = bytes;
+    _rateRequests = requests;
+    _rateInterval = interval > 0 ? interval : 1;
+    _rateFactor = 100;
+    // start with full buckets
+    _byteTokens = (int64_t)_rateBytes * _rateInterval * 1000;
+    _requestTokens = (int64_t)_rateRequests * _rateInterval * 1000;
+    _rateTime = millis();
+}
+
+int64_t InfluxDBClient::getActualRate(uint32_t limit) const {
+    int64_t rate = (int64_t)limit * _rateFactor / 100;
+    // low limit lowered after 429 would otherwise be truncated to zero and block writing forever
+    return rate > 0 ? rate : 1;
+}
+
+void InfluxDBClient::refillWriteTokens() {
+    // Tokens are kept multiplied by interval in ms, so refill by elapsed time is exact in integers.
+    // Bucket capacity is the amount allowed per interval
+    uint32_t now = millis();
+    uint32_t elapsed = now - _rateTime;
+    _rateTime = now;
+    int64_t intervalMs = (int64_t)_rateInterval * 1000;
+    int64_t byteRate = getActualRate(_rateBytes);
+    int64_t requestRate = getActualRate(_rateRequests);
+    _byteTokens += elapsed * byteRate;
+    if(_byteTokens > byteRate * intervalMs) {
+        _byteTokens = byteRate * intervalMs;
+    }
+    _requestTokens += elapsed * requestRate;
+    if(_requestTokens > requestRate * intervalMs) {
+        _requestTokens = requestRate * intervalMs;
+    }
+}
+
+bool InfluxDBClient::hasWriteTokens() {
+    if(!_rateBytes && !_rateRequests) {
+        return true;
+    }
+    INFLUXDB_CLIENT_TRACE_BEGIN(Pacing);
+    refillWriteTokens();
+    bool allowed = (!_rateBytes || _byteTokens > 0) && (!_rateRequests || _requestTokens >= (int64_t)_rateInterval * 1000);
+    INFLUXDB_CLIENT_TRACE_END(Pacing);
+    return allowed;
+}
+
+bool InfluxDBClient::acquireWriteTokens(uint32_t bytes) {
+    if(!_rateBytes && !_rateRequests) {
+        return true;
+    }
+    INFLUXDB_CLIENT_TRACE_BEGIN(Pacing);
+    refillWriteTokens();
+    int64_t intervalMs = (int64_t)_rateInterval * 1000;
+    int64_t byteRate = getActualRate(_rateBytes);
+    // batch bigger than capacity is allowed when bucket is full, otherwise it would never be sent
+    bool bytesOk = !_rateBytes || _byteTokens >= bytes * intervalMs || _byteTokens == byteRate * intervalMs;
+    bool requestsOk = !_rateRequests || _requestTokens >= intervalMs;
+    bool allowed = bytesOk && requestsOk;
+    if(allowed) {
+        if(_rateBytes) {
+            _byteTokens -= bytes * intervalMs;
+        }
+        if(_rateRequests) {
+            _requestTokens -= intervalMs;
+        }
+    }
+    INFLUXDB_CLIENT_TRACE_END(Pacing);
+    return allowed;
+}
+
+void InfluxDBClient::updateWriteRate(int statusCode) {
+    if(!_rateBytes && !_rateRequests) {
+        return;
+    }
+    if(statusCode == 429) {
+        // Quota is lower than configured. Halve the rate and empty buckets, so sending resumes slowly after Retry-After period.
+        // Retry-After only tells when to send again, not the allowed rate, so the rate is found by additive increase and multiplicative decrease
+        _rateFactor = _rateFactor/2 > WRITE_RATE_MIN_FACTOR ? _rateFactor/2 : WRITE_RATE_MIN_FACTOR;
+        _byteTokens = 0;
+        _requestTokens = 0;
+        INFLUXDB_CLIENT_DEBUG("[D] Write rate lowered to %d%%\n", _rateFactor);
+    } else if(statusCode == 204 && _rateFactor < 100) {
+        _rateFactor = _rateFactor + WRITE_RATE_STEP < 100 ? _rateFactor + WRITE_RATE_STEP : 100;
+    }
+}
+
+char *InfluxDBClient::prepareBatch(int &size, int &lines, uint16_t maxLines, uint16_t maxRecords) {
     size = 0;
+    lines = 0;
     int length = 0;
     char *buff = nullptr;
-    uint16_t top = _batchPointer+_batchSize;
+    uint16_t top = _batchPointer+maxRecords;
     INFLUXDB_CLIENT_DEBUG("[D] Prepare batch: bufferPointer: %d, batchPointer: %d, ceiling %d\n", _bufferPointer, _batchPointer, _bufferCeiling);
     if(top > _bufferCeiling ) {
         // are we returning to the begining?
@@ -378,9 +1339,16 @@ char *InfluxDBClient::prepareBatch(int &size) {
     }
     INFLUXDB_CLIENT_DEBUG("[D] Prepare batch size %d\n", size);
     if(size) {
+        INFLUXDB_CLIENT_TRACE_BEGIN(Serialize);
         int i = _batchPointer;
         for(int c=0; c < size; c++) {
-            length += _pointsBuffer[i++].length();
+            if(c > 0 && lines + _linesBuffer[i] > maxLines) {
+                // batch size is reached by lines of records
+                size = c;
+                break;
+            }
+            lines += _linesBuffer[i];
+            length += recordLength(_pointsBuffer[i++]);
             if(i == _bufferSize) {
                 i = 0;
             }
@@ -389,19 +1357,20 @@ char *InfluxDBClient::prepareBatch(int &size) {
         //create buffer for all lines including new line char and terminating char
         buff = new char[length + size + 1];
         if(buff) {
-            buff[0] = 0;
+            char *p = buff;
             int i = _batchPointer;
+            // compact records are converted to line protocol here
             for(int c=0; c < size; c++) {
-                strcat(buff+strlen(buff), _pointsBuffer[i++].c_str());
-                strcat(buff+strlen(buff), "\n");
+                p += copyRecord(p, _pointsBuffer[i++]);
+                *p++ = '\n';
                 if(i == _bufferSize) {
                     i = 0;
                 }
                 yield();
             }
-        } else {
-            size = 0;
+            *p = 0;
         }
+        INFLUXDB_CLIENT_TRACE_END(Serialize);
     }
     return buff;
 }
@@ -412,16 +1381,22 @@ bool InfluxDBClient::validateConnection() {
         _lastErrorResponse = FPSTR(UnitialisedMessage);
         return false;
     }
-    String url = _serverUrl + "/ready";
-    INFLUXDB_CLIENT_DEBUG("[D] Validating connection to %s\n", url.c_str());
+    selectServer();
+    resolveServer();
+    INFLUXDB_CLIENT_DEBUG("[D] Validating connection to %s\n", _readyUrl.c_str());
 
-    if(!_httpClient.begin(*_wifiClient, url)) {
+    if(!_httpClient.begin(*_wifiClient, _readyUrl)) {
         INFLUXDB_CLIENT_DEBUG("[E] begin failed\n");
         return false;
     }
     _httpClient.addHeader(F("Accept"), F("application/json"));
+    const char * headerKeys[] = {DateHeader} ;
+    _httpClient.collectHeaders(headerKeys, 1);
     
+    INFLUXDB_CLIENT_TRACE_BEGIN(HTTPRequest);
     _lastStatusCode = _httpClient.GET();
+    INFLUXDB_CLIENT_TRACE_END(HTTPRequest);
+    updateServerHealth(0);
 
    _lastErrorResponse = "";
     
@@ -435,8 +1410,8 @@ bool InfluxDBClient::validateConnection() {
 void InfluxDBClient::preRequest() {
     _httpClient.addHeader(F("Authorization"), "Token " + _authToken);
     
-    const char * headerKeys[] = {RetryAfter} ;
-    _httpClient.collectHeaders(headerKeys, 1);
+    const char * headerKeys[] = {RetryAfter, DateHeader, ContentEncoding, TransferEncoding} ;
+    _httpClient.collectHeaders(headerKeys, 4);
 }
 
 int InfluxDBClient::postData(const char *data) {
@@ -446,9 +1421,13 @@ int InfluxDBClient::postData(const char *data) {
         return 0;
     }
     if(data) {
+        INFLUXDB_CLIENT_TRACE_BEGIN(Write);
+        selectServer();
+        resolveServer();
         INFLUXDB_CLIENT_DEBUG("[D] Writing to %s\n", _writeUrl.c_str());
         if(!_httpClient.begin(*_wifiClient, _writeUrl)) {
             INFLUXDB_CLIENT_DEBUG("[E] Begin failed\n");
+            INFLUXDB_CLIENT_TRACE_END(Write);
             return false;
         }
         INFLUXDB_CLIENT_DEBUG("[D] Sending:\n%s\n", data);       
@@ -457,12 +1436,19 @@ int InfluxDBClient::postData(const char *data) {
         
         preRequest();        
         
+        uint32_t start = millis();
+        INFLUXDB_CLIENT_TRACE_BEGIN(HTTPRequest);
         _lastStatusCode = _httpClient.POST((uint8_t*)data, strlen(data));
+        INFLUXDB_CLIENT_TRACE_END(HTTPRequest);
+        updateServerHealth(millis() - start);
         
+        INFLUXDB_CLIENT_TRACE_BEGIN(ReadResponse);
         postRequest(204);
+        INFLUXDB_CLIENT_TRACE_END(ReadResponse);
 
         
         _httpClient.end();
+        INFLUXDB_CLIENT_TRACE_END(Write);
     } 
     return _lastStatusCode;
 }
@@ -477,28 +1463,57 @@ String InfluxDBClient::query(String &fluxQuery) {
         _lastErrorResponse = FPSTR(UnitialisedMessage);
         return "";
     }
+    INFLUXDB_CLIENT_TRACE_BEGIN(Query);
+    selectServer();
+    resolveServer();
     INFLUXDB_CLIENT_DEBUG("[D] Query to %s\n", _queryUrl.c_str());
     if(!_httpClient.begin(*_wifiClient, _queryUrl)) {
         INFLUXDB_CLIENT_DEBUG("[E] begin failed\n");
+        INFLUXDB_CLIENT_TRACE_END(Query);
         return "";
     }
     _httpClient.addHeader(F("Content-Type"), F("application/vnd.flux"));
+    // CSV is highly repetitive, compressed response is many times smaller
+    _httpClient.addHeader(F("Accept-Encoding"), F("gzip"));
     
     INFLUXDB_CLIENT_DEBUG("[D] JSON query:\n%s\n", fluxQuery.c_str());
     
     preRequest();
 
+    INFLUXDB_CLIENT_TRACE_BEGIN(HTTPRequest);
     _lastStatusCode = _httpClient.POST(fluxQuery);
+    INFLUXDB_CLIENT_TRACE_END(HTTPRequest);
+    updateServerHealth(0);
     
     postRequest(200);
     String queryResult;
     if(_lastStatusCode == 200) {
-        queryResult = _httpClient.getString();
+        if(_httpClient.header(ContentEncoding).equalsIgnoreCase(F("gzip"))) {
+            GzipInflater *inflater = new GzipInflater(_httpClient.getStreamPtr(), _httpClient.getSize(),
+                _httpClient.header(TransferEncoding).equalsIgnoreCase(F("chunked")));
+            INFLUXDB_CLIENT_TRACE_BEGIN(Inflate);
+            bool inflated = inflater->inflate(queryResult);
+            INFLUXDB_CLIENT_TRACE_END(Inflate);
+            if(!inflated) {
+                _lastStatusCode = 0;
+                _lastErrorResponse = inflater->getError();
+                INFLUXDB_CLIENT_DEBUG("[E] Inflate error - %s\n", _lastErrorResponse.c_str());
+                queryResult = "";
+                // rest of response is unknown, connection cannot be reused
+                _wifiClient->stop();
+            }
+            delete inflater;
+        } else {
+            INFLUXDB_CLIENT_TRACE_BEGIN(ReadResponse);
+            queryResult = _httpClient.getString();
+            INFLUXDB_CLIENT_TRACE_END(ReadResponse);
+        }
         queryResult.trim();
         INFLUXDB_CLIENT_DEBUG("[D] Response:\n%s\n", queryResult.c_str());
     }
 
     _httpClient.end();
+    INFLUXDB_CLIENT_TRACE_END(Query);
 
     return queryResult;
 }
@@ -506,6 +1521,14 @@ String InfluxDBClient::query(String &fluxQuery) {
 void InfluxDBClient::postRequest(int expectedStatusCode) {
     _lastRequestTime = millis();
      INFLUXDB_CLIENT_DEBUG("[D] HTTP status code - %d\n", _lastStatusCode);
+    if(_lastStatusCode < 0 && uint32_t(_serverIP) != 0) {
+        // address could have changed, resolve it again before the next request
+        _serverIP = IPAddress();
+        setUrls();
+    }
+    if(_lastStatusCode > 0 && _httpClient.hasHeader(DateHeader)) {
+        updateServerTime(_httpClient.header(DateHeader));
+    }
     if(_lastStatusCode == 429 || _lastStatusCode == 503) { //retryable 
         int retry = 0;
         if(_httpClient.hasHeader(RetryAfter)) {
@@ -533,59 +1556,357 @@ void InfluxDBClient::postRequest(int expectedStatusCode) {
     }
 }
 
-static String escapeKey(String key) {
-    String ret;
-    ret.reserve(key.length()+5); //5 is estimate of  chars needs to escape,
-    
-    for (char c: key)
-    {
-        switch (c)
-        {
-            case ' ':
-            case ',':
-            case '=':
-                ret += '\\';
-                break;
+void InfluxDBClient::updateServerTime(const String &date) {
+    uint32_t serverTime = parseHttpDate(date.c_str());
+    if(serverTime == 0) {
+        INFLUXDB_CLIENT_DEBUG("[E] Invalid Date header: %s\n", date.c_str());
+        return;
+    }
+    // Date header has 1s resolution. Keep the current sync, unless it has already drifted out of the reported second,
+    // so the sub-second phase taken at the first sync isn't lost by later responses
+    if(getServerTime() != serverTime) {
+        _serverTime = serverTime;
+        _serverTimeMillis = millis();
+        INFLUXDB_CLIENT_DEBUG("[D] Server time synced: %u\n", _serverTime);
+    }
+}
+
+unsigned long InfluxDBClient::getServerTime() const {
+    if(_serverTime == 0) {
+        return 0;
+    }
+    return _serverTime + (millis() - _serverTimeMillis)/1000;
+}
+
+// Parses HTTP date in the RFC 1123 format, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+// Returns seconds since epoch or 0 in case of a format error
+static uint32_t parseHttpDate(const char *date) {
+    static const char Months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char *p = strchr(date, ',');
+    if(!p) {
+        return 0;
+    }
+    int day, year, hour, min, sec;
+    char mon[4];
+    if(sscanf(p + 1, " %d %3s %d %d:%d:%d", &day, mon, &year, &hour, &min, &sec) != 6) {
+        return 0;
+    }
+    const char *m = strstr(Months, mon);
+    if(!m || strlen(mon) != 3 || (m - Months) % 3 || year < 1970) {
+        return 0;
+    }
+    int month = (m - Months) / 3 + 1;
+    // days from civil date, see http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+    year -= month <= 2;
+    int era = year / 400;
+    int yoe = year - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    uint32_t days = era * 146097 + doe - 719468;
+    return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+#if defined(ESP8266)
+static bool rtcRead(uint16_t offset, uint32_t *data, size_t size) {
+    return ESP.rtcUserMemoryRead(RTC_BUFFER_OFFSET + offset, data, size);
+}
+
+static bool rtcWrite(uint16_t offset, const uint32_t *data, size_t size) {
+    return ESP.rtcUserMemoryWrite(RTC_BUFFER_OFFSET + offset, (uint32_t *)data, size);
+}
+#elif defined(ESP32) && RTC_BUFFER_SIZE > 0
+static bool rtcRead(uint16_t offset, uint32_t *data, size_t size) {
+    memcpy(data, rtcMemory + offset, size);
+    return true;
+}
+
+static bool rtcWrite(uint16_t offset, const uint32_t *data, size_t size) {
+    memcpy(rtcMemory + offset, data, size);
+    return true;
+}
+#else
+// RTC buffer is disabled
+static bool rtcRead(uint16_t, uint32_t *, size_t) {
+    return false;
+}
+
+static bool rtcWrite(uint16_t, const uint32_t *, size_t) {
+    return false;
+}
+#endif
+
+// Computes FNV-1a hash of RTC buffer header and data
+static uint32_t checksum(const RTCBufferHeader &header, const uint8_t *data) {
+    uint32_t hash = 2166136261u;
+    uint32_t sizes = ((uint32_t)header.count << 16) | header.length;
+    for(int i = 0; i < 4; i++) {
+        hash = (hash ^ ((sizes >> (i*8)) & 0xFF)) * 16777619u;
+    }
+    for(uint16_t i = 0; i < header.length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Skips measurement, tag key or tag value up to unescaped comma, equal sign or space
+static const char *skipKey(const char *p, bool stopOnEqual) {
+    for(; *p && *p != '\n' && *p != '\r' && *p != ',' && *p != ' ' && !(stopOnEqual && *p == '='); p++) {
+        if(*p == '\\' && p[1] && p[1] != '\n') {
+            p++;
         }
+    }
+    return p;
+}
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
 
-        ret += c;
+// Checks whether field value in [p, end) is a valid float, integer, unsigned integer or boolean
+static bool isValidFieldValue(const char *p, const char *end) {
+    int len = end - p;
+    switch(*p) {
+        case 't': case 'T': case 'f': case 'F':
+            if(len == 1) {
+                return true;
+            }
+            return (len == 4 && (!strncmp(p, "true", 4) || !strncmp(p, "True", 4) || !strncmp(p, "TRUE", 4)))
+                || (len == 5 && (!strncmp(p, "false", 5) || !strncmp(p, "False", 5) || !strncmp(p, "FALSE", 5)));
     }
-    return ret;
+    bool negative = *p == '-';
+    if(negative) {
+        p++;
+    }
+    const char *digits = p;
+    while(p < end && isDigit(*p)) {
+        p++;
+    }
+    if(p < end && p > digits && p + 1 == end && (*p == 'i' || (*p == 'u' && !negative))) {
+        // value must fit into int64 or uint64
+        const char *max = *p == 'u' ? "18446744073709551615" : (negative ? "9223372036854775808" : "9223372036854775807");
+        while(*digits == '0' && digits + 1 < p) {
+            digits++;
+        }
+        size_t count = p - digits;
+        size_t maxCount = strlen(max);
+        return count < maxCount || (count == maxCount && strncmp(digits, max, count) <= 0);
+    }
+    bool hasDigits = p > digits;
+    if(p < end && *p == '.') {
+        const char *fraction = ++p;
+        while(p < end && isDigit(*p)) {
+            p++;
+        }
+        hasDigits = hasDigits || p > fraction;
+    }
+    if(hasDigits && p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if(p < end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+        const char *exponent = p;
+        while(p < end && isDigit(*p)) {
+            p++;
+        }
+        if(p == exponent) {
+            return false;
+        }
+    }
+    return hasDigits && p == end;
 }
 
-static String escapeValue(const char *value) {
-    String ret;
-    int len = strlen_P(value);
-    ret.reserve(len+5); //5 is estimate of max chars needs to escape,
-    for(int i=0;i<len;i++)
-    {
-        switch (value[i])
-        {
-            case '\\':
-            case '\"':
-                ret += '\\';
-                break;
+// Validates single line of line protocol
+// Returns nullptr when line is valid, otherwise reason of failure. Sets end to the end of line.
+static const char *validateLine(const char *p, const char *&end) {
+    // measurement
+    if(*p == PACKED_RECORD_MARKER) {
+        return "invalid measurement";
+    }
+    const char *s = p;
+    p = skipKey(p, false);
+    if(p == s) {
+        return "missing measurement";
+    }
+    // tags
+    while(*p == ',') {
+        s = ++p;
+        p = skipKey(p, true);
+        if(p == s || *p != '=') {
+            return "invalid tag key";
+        }
+        s = ++p;
+        // unescaped equal sign in tag value is rejected by server
+        p = skipKey(p, true);
+        if(p == s || *p == '=') {
+            return "invalid tag value";
+        }
+    }
+    if(*p != ' ') {
+        return "missing fields";
+    }
+    while(*p == ' ') {
+        p++;
+    }
+    // fields
+    do {
+        if(*p == ',') {
+            p++;
         }
+        s = p;
+        p = skipKey(p, true);
+        if(p == s || *p != '=') {
+            return "invalid field key";
+        }
+        s = ++p;
+        if(*p == '"') {
+            for(p++; *p && *p != '"'; p++) {
+                if(*p == '\\' && p[1]) {
+                    p++;
+                }
+            }
+            if(*p != '"') {
+                return "unterminated string field value";
+            }
+            p++;
+        } else {
+            while(*p && *p != '\n' && *p != '\r' && *p != ',' && *p != ' ') {
+                p++;
+            }
+            if(p == s || !isValidFieldValue(s, p)) {
+                return "invalid field value";
+            }
+        }
+    } while(*p == ',');
+    // timestamp
+    while(*p == ' ') {
+        p++;
+    }
+    if(*p && *p != '\n' && *p != '\r') {
+        s = p;
+        if(*p == '-') {
+            p++;
+        }
+        while(isDigit(*p)) {
+            p++;
+        }
+        if(p == s || (*s == '-' && p == s + 1)) {
+            return "invalid timestamp";
+        }
+        while(*p == ' ') {
+            p++;
+        }
+    }
+    if(*p == '\r') {
+        p++;
+    }
+    if(*p && *p != '\n') {
+        return "invalid timestamp";
+    }
+    end = p;
+    return nullptr;
+}
 
-        ret += value[i];
+// Validates record consisting of one or more lines of line protocol
+// Returns nullptr when record is valid, otherwise reason of failure
+static const char *validateRecord(const char *record) {
+    const char *p = record;
+    bool empty = true;
+    while(*p) {
+        if(*p == '\n' || *p == '\r') {
+            // skip empty lines
+            p++;
+            continue;
+        }
+        const char *end;
+        const char *error = validateLine(p, end);
+        if(error) {
+            return error;
+        }
+        empty = false;
+        p = end;
+    }
+    return empty ? "empty record" : nullptr;
+}
+
+// Returns string in [begin,end) with escape backslashes removed
+static String unescape(const char *begin, const char *end) {
+    String ret;
+    ret.reserve(end - begin);
+    for(const char *p = begin; p < end; p++) {
+        if(*p == '\\' && p + 1 < end) {
+            p++;
+        }
+        ret += *p;
     }
     return ret;
 }
-static String escapeTagValue(const char *value) {
+
+// Escapes string for using as a string literal in Flux
+static String escapeFluxString(const String &value) {
     String ret;
-    int len = strlen_P(value);
-    ret.reserve(len+5); //5 is estimate of max chars needs to escape,
-    for(int i=0;i<len;i++)
-    {
-        switch (value[i])
-        {
-            case '\\':
-            case '\"':
-                ret += '\\';
-                break;
+    escapeTo(ret, value.c_str(), "\\\"$");
+    return ret;
+}
+
+// Returns field at index from CSV line, unquoted. Returns empty string if line has less fields
+static String getCSVField(const String &line, int index) {
+    unsigned int i = 0;
+    for(int field = 0; i <= line.length(); field++) {
+        String value;
+        bool quoted = line[i] == '"';
+        if(quoted) {
+            for(i++; i < line.length(); i++) {
+                if(line[i] == '"') {
+                    if(line[i + 1] != '"') {
+                        i++;
+                        break;
+                    }
+                    i++;
+                }
+                value += line[i];
+            }
+        } else {
+            while(i < line.length() && line[i] != ',') {
+                value += line[i++];
+            }
         }
+        if(field == index) {
+            return value;
+        }
+        // skip separator
+        i++;
+    }
+    return "";
+}
 
-        ret += value[i];
+// Formats unsigned 64bit number, buff must have at least 21 chars
+static char *formatUInt64(char *buff, uint64_t value) {
+    char *p = buff + 20;
+    *p = 0;
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    return p;
+}
+
+// Appends src to dest, prefixing each char from escapeChars with backslash.
+// Most of keys and values don't contain any special char, so the input is scanned first
+// and appended at once. Only when a special char is found it is copied char by char.
+static void escapeTo(String &dest, const char *src, const char *escapeChars) {
+    const char *special = strpbrk(src, escapeChars);
+    if(!special) {
+        dest += src;
+        return;
+    }
+    dest.reserve(dest.length() + strlen(src) + 5); //5 is estimate of max chars needs to escape
+    for(const char *c = src; c < special; c++) {
+        dest += *c;
+    }
+    for(const char *c = special; *c; c++) {
+        if(strchr(escapeChars, *c)) {
+            dest += '\\';
+        }
+        dest += *c;
     }
-    return ret;
 }
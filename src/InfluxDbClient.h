@@ -28,6 +28,7 @@
 */
 
 #include "Arduino.h"
+#include "InfluxDbTrace.h"
 
 #if defined(ESP8266)
 # include <WiFiClientSecureBearSSL.h>
@@ -42,6 +43,15 @@
 #error AxTLS doesn't work
 #endif
 
+// Maximum number of servers client can fail over to, including the primary one
+#define INFLUXDB_CLIENT_MAX_SERVERS 4
+
+// Size of RTC slow memory reserved on ESP32 for setRTCBuffer(), multiple of 4. 0 doesn't reserve any memory and disables RTC buffer.
+// On ESP8266 RTC user memory is not reserved, so the size is fixed
+#ifndef INFLUXDB_CLIENT_RTC_BUFFER_SIZE
+#define INFLUXDB_CLIENT_RTC_BUFFER_SIZE 512
+#endif
+
 // Enum WritePrecision defines constants for specifying InfluxDB write prcecision
 enum class WritePrecision  {
   // Specifyies that points has no timestamp (default) 
@@ -102,6 +112,9 @@ class Point {
     String _timestamp;    
     // method for formating field into line protocol
     void putField(String name, String value);
+    // Creates series key, i.e. measurement and tags in line protocol
+    String createSeriesKey() const;
+    friend class InfluxDBClient;
 };
 
 // InfluxDBClient handles connection and basic operations for InfluxDB 2
@@ -142,15 +155,60 @@ class InfluxDBClient {
     // authToken - InfluxDB 2 authorization token
     // serverCert - Optional. InfluxDB 2 server trusted certificate (or CA certificate) or certificate SHA1 fingerprint.  Should be stored in PROGMEM. Only in case of https connection.
     void setConnectionParams(const char *serverUrl, const char *org, const char *bucket, const char *authToken, const char *serverCert = nullptr);
+    // Adds alternative url of server with the same organization, bucket and token (e.g. other node of a cluster).
+    // When the current server fails, the client switches to another one. Among healthy servers, the one with the lowest response time is preferred.
+    // Url must have the same scheme (http/https) as the primary server url and in case of https the same certificate info must be valid.
+    // Returns false if list of servers is full or url is not valid
+    bool addServerUrl(const char *serverUrl);
     // Validates connection parameters by conecting to server
     // Returns true if successful, false in case of any error
     bool validateConnection();
+    // Enables caching of resolved server address for ttl seconds, 0 disables caching.
+    // Cached address is used only for http connection, as https requires the host name for server verification.
+    // When connection fails, the address is resolved again
+    void setDNSCacheTTL(uint32_t ttl);
+    // Resolves server address and connects to server in advance, so the first write doesn't wait for DNS lookup and TCP/TLS handshake.
+    // Connection is kept open only when preserveConnection is set in setWriteOptions
+    // Returns true if successful, false in case of any error
+    bool warmup();
     // Writes record in InfluxDB line protocol format to buffer
+    // Record is validated first and rejected when it is not a valid line protocol, see getLastErrorMessage() for the reason.
     // Returns true if successful, false in case of any error 
     bool writeRecord(String &record);
     // Writes record represented by Point to buffer
     // Returns true if successful, false in case of any error 
     bool writePoint(Point& point);
+    // Limits writing to bytes and requests (batches) per interval in seconds, e.g. to stay under write quota of InfluxDB Cloud. 0 means no limit.
+    // Batches are sent only when enough allowance has accumulated, otherwise they are kept in buffer and flushBuffer() returns false, as during Retry-After period.
+    // Smaller interval gives smoother sending. When server replies 429 anyway, the rate is halved and it slowly returns to the limit after successful writes.
+    void setWriteRateLimit(uint32_t bytes, uint16_t requests, uint16_t interval = 60);
+    // Enables keeping points in buffer in compact form, where measurement and tags are replaced by index to a table of up to maxSeries series
+    // and timestamp is packed, and converting them to line protocol only when a batch is written. So more points fit into memory, e.g. during network outage.
+    // Points of series, which don't fit in the table, are kept as line protocol. 0 disables it
+    void setDeferredSerialization(uint8_t maxSeries);
+    // Writes samples of one field of a series at once, e.g. a burst of measurements. It is much faster than writing a point for each sample.
+    // series - point with measurement and tags of the series, its fields and timestamp are not used
+    // field - name of the field
+    // values - array of count values, NaN values are skipped
+    // decimalPlaces - count of decimal places of float and double values, at most 17
+    // timestamps - array of count timestamps in the precision set by setWriteOptions, or nullptr for samples without timestamp
+    // Samples are serialized into records of up to batch size lines. Each record takes one place in the buffer and its lines count towards batch size,
+    // so buffer size should be at least count/batchSize and a single write contains at most batchSize lines.
+    // Returns true if successful, false in case of any error
+    bool writeSamples(Point &series, const char *field, const float *values, const uint64_t *timestamps, uint16_t count, int decimalPlaces = 2);
+    bool writeSamples(Point &series, const char *field, const double *values, const uint64_t *timestamps, uint16_t count, int decimalPlaces = 2);
+    bool writeSamples(Point &series, const char *field, const int *values, const uint64_t *timestamps, uint16_t count);
+    bool writeSamples(Point &series, const char *field, const long *values, const uint64_t *timestamps, uint16_t count);
+    bool writeSamples(Point &series, const char *field, const bool *values, const uint64_t *timestamps, uint16_t count);
+    // Enables keeping last written values of up to maxValues fields in memory, so they can be read without querying server.
+    // When the limit is reached, the least recently used value is replaced. 0 disables caching
+    void setLastValueCache(uint8_t maxValues);
+    // Returns the last value of a field of the series given by measurement and tags of the point, e.g. "23", "1.50", "true" or "text" for string field.
+    // Value written by this client is taken from the last value cache. If not found there, it is queried from server.
+    // Tags are compared in the order they were added, so the series point must add them in the same order as the written points,
+    // otherwise the cache is missed and the value is queried.
+    // Returns empty string if value was not found
+    String getLastValue(Point &series, String field);
     // Sends Flux query and returns raw JSON formatted response
     // Return raw query response in the form of CSV table. Empty string can mean that query hasn't found anything or an error. Check getLastStatusCode() for 200 
     String query(String &fluxQuery);
@@ -166,14 +224,32 @@ class InfluxDBClient {
     bool checkBuffer();
     // Wipes out buffered points
     void resetBuffer();
+    // Enables keeping not yet written points also in RTC memory, which is preserved during deep sleep.
+    // Points kept from the previous run are restored into the buffer, so a device can collect points over several
+    // wakeups and connect to WiFi only when a batch is to be written. Call after setWriteOptions(), before writing points.
+    // Capacity is limited by RTC memory size, only 384 bytes on ESP8266 and INFLUXDB_CLIENT_RTC_BUFFER_SIZE (512 bytes by default) on ESP32.
+    // The oldest points are skipped when they don't fit.
+    void setRTCBuffer(bool enable);
     // Returns HTTP status of last request to server. Usefull for advanced handling of failures.
     int getLastStatusCode() const { return _lastStatusCode;  }
     // Returns last response when operation failed
     String getLastErrorMessage() const { return _lastErrorResponse; }
-    // Returns server url
+    // Returns number of buffered records the server has rejected and that have been discarded.
+    // When a batch is rejected as a bad request (400) or too large (413), it is split and only invalid records are discarded
+    uint32_t getRejectedCount() const { return _rejectedCount; }
+    // Returns url of currently used server
     String getServerUrl() const { return _serverUrl; }
     // Returns true if last query request has succeeded. Handy for distingushing empty result and error
     bool wasLastQuerySuccessful() { return _lastStatusCode == 200; }
+    // Enables timestamping points, which don't have timestamp, by time derived from the Date header of server responses.
+    // Such time is available right after the first request (e.g. validateConnection()), without waiting for NTP. Precision is about 1s.
+    void setUseServerTime(bool useServerTime) { _useServerTime = useServerTime; }
+    // Returns current time in seconds since epoch derived from the last server response, or 0 if there was no response yet
+    unsigned long getServerTime() const;
+#ifdef INFLUXDB_CLIENT_TRACE
+    // Returns trace of write and query phases, e.g. client.getTrace().print(Serial)
+    InfluxDBTrace &getTrace() { return _trace; }
+#endif
   protected:
     // Checks params and sets up security, if needed.
     // Returns true in case of success, otherwise false
@@ -184,9 +260,64 @@ class InfluxDBClient {
     void postRequest(int expectedStatusCode);
     // Cleans instances
     void clean();
+    // Allocates empty points buffer
+    void clearBuffer();
+    // Adds record to points buffer, oldest record is overwritten when buffer is full
+    void addToBuffer(String &record);
+    // Adds already validated record to buffer and flushes buffer if needed
+    bool bufferRecord(String &record);
+    // Returns index of series of the point in series table, series is added if not found. Returns -1 if table is full
+    int internSeries(Point &point);
+    // Creates compact record from the point, returns false if the point cannot be stored in compact form
+    bool packRecord(Point &point, String &record);
+    // Returns length of record in line protocol
+    uint16_t recordLength(const String &record) const;
+    // Writes record in line protocol into dest without terminating zero, returns number of written chars
+    uint16_t copyRecord(char *dest, const String &record) const;
+    // Returns actual rate per interval for the limit lowered by _rateFactor, at least 1
+    int64_t getActualRate(uint32_t limit) const;
+    // Adds tokens to rate limiter buckets according to elapsed time
+    void refillWriteTokens();
+    // Returns true if rate limiter allows sending a request, without taking tokens
+    bool hasWriteTokens();
+    // Takes tokens for a request with bytes from rate limiter buckets. Returns false if there isn't enough tokens
+    bool acquireWriteTokens(uint32_t bytes);
+    // Adapts write rate according to response status
+    void updateWriteRate(int statusCode);
+    // Type of values array passed to writeSamples
+    enum class SampleType { Float, Double, Int, Long, Bool };
+    // Serializes samples of a field into records of up to batch size lines and adds them to buffer
+    bool bufferSamples(Point &series, const char *field, SampleType type, const void *values, const uint64_t *timestamps, uint16_t count, int decimalPlaces);
+    // Formats value at index of values array into buff of SAMPLE_BUFFER_SIZE chars, integers without type suffix. Returns false for NaN
+    static bool formatSample(char *buff, SampleType type, const void *values, uint16_t index, int decimalPlaces);
+    // Returns number of records in buffer, which have not been written yet
+    uint16_t pendingCount() const;
+    // Returns number of lines of records, which have not been written yet. Counting stops when limit is reached
+    uint16_t pendingLines(uint16_t limit) const;
+    // Stores records not written yet into RTC memory
+    // Returns false if all records didn't fit
+    bool saveRTCBuffer();
+    // Restores records from RTC memory into buffer
+    void restoreRTCBuffer();
   protected:
+    // Server url with health tracking
+    struct ServerEndpoint {
+        String url;
+        // Number of consecutive failed requests
+        uint8_t failures = 0;
+        // Time in ms of the last failure
+        uint32_t lastFailure = 0;
+        // Smoothed response time of write requests in ms, 0 if not measured yet
+        uint32_t latency = 0;
+    };
     // Connection info
     String _serverUrl;
+    // Primary and alternative servers
+    ServerEndpoint _servers[INFLUXDB_CLIENT_MAX_SERVERS];
+    // Number of configured servers
+    uint8_t _serversCount = 0;
+    // Index of currently used server
+    uint8_t _currentServer = 0;
     String _bucket;
     String _org;
     // token authetication
@@ -195,6 +326,16 @@ class InfluxDBClient {
     String _writeUrl;
     // Cached full query url
     String _queryUrl;
+    // Cached full ready url
+    String _readyUrl;
+    // Cached server address, valid when non-zero
+    IPAddress _serverIP;
+    // Time in ms the server address has been resolved
+    uint32_t _serverIPTime = 0;
+    // Number of seconds to keep resolved server address
+    uint32_t _dnsCacheTTL = 0;
+    // Whether HTTP connection should be kept open
+    bool _preserveConnection = false;
     // Points timestamp precision. 
     WritePrecision _writePrecision = WritePrecision::NoTime;
     // Number of points that will be written to the databases at once. 
@@ -202,6 +343,8 @@ class InfluxDBClient {
     uint16_t _batchSize = 1;
     // Points buffer
     String *_pointsBuffer = nullptr;
+    // Number of lines of each record in points buffer
+    uint16_t *_linesBuffer = nullptr;
     // Rewrites buffer size - maximum number of record to keep.
     // When max size is reached, oldest records are overwritten
     uint16_t _bufferSize = 5;
@@ -213,12 +356,38 @@ class InfluxDBClient {
     uint16_t _bufferCeiling = 0;
     // Index of start for next write
     uint16_t _batchPointer = 0;
+    // Write rate limit, 0 means no limit
+    uint32_t _rateBytes = 0;
+    uint16_t _rateRequests = 0;
+    // Write rate limit interval in seconds
+    uint16_t _rateInterval = 60;
+    // Actual write rate in percent of the limit
+    uint8_t _rateFactor = 100;
+    // Rate limiter buckets, tokens are multiplied by interval in ms
+    int64_t _byteTokens = 0;
+    int64_t _requestTokens = 0;
+    // Time in ms of the last buckets refill
+    uint32_t _rateTime = 0;
+#ifdef INFLUXDB_CLIENT_TRACE
+    // Recorded phases of requests
+    InfluxDBTrace _trace;
+#endif
+    // Series keys of points kept in compact form
+    String *_seriesKeys = nullptr;
+    // Maximum number of series in table
+    uint8_t _seriesKeysSize = 0;
+    // Number of series in table
+    uint8_t _seriesCount = 0;
+    // Whether to keep buffer also in RTC memory
+    bool _rtcBuffer = false;
     // Last time in sec bufer has been sucessfully flushed
     uint32_t _lastFlushed = 0;
     // Last time in ms we made are a request to server
     uint32_t _lastRequestTime = 0;
     // HTTP status code of last request to server
     int _lastStatusCode = 0;
+    // Number of records rejected by server
+    uint32_t _rejectedCount = 0;
     // Server reponse or library error message for last failed request
     String _lastErrorResponse;
     // Underlying HTTPClient instance 
@@ -232,16 +401,57 @@ class InfluxDBClient {
 #endif
     // Store retry timeout suggested by server after last request
     int _lastRetryAfter;
+    // Server time in seconds since epoch, parsed from Date header of a response
+    uint32_t _serverTime = 0;
+    // Time in ms the _serverTime has been taken
+    uint32_t _serverTimeMillis = 0;
+    // Whether to use server time for timestamping points
+    bool _useServerTime = false;
+    // Synchronizes server time from the Date header
+    void updateServerTime(const String &date);
+    // Last written value of a field of a series
+    struct LastValue {
+        // Series key and field key in line protocol
+        String key;
+        String value;
+        // Value of _lastValueClock when the value was used
+        uint32_t lastUsed;
+    };
+    // Last values cache
+    LastValue *_lastValues = nullptr;
+    // Maximum number of values in cache
+    uint8_t _lastValuesSize = 0;
+    // Counter for finding least recently used value
+    uint32_t _lastValueClock = 0;
+    // Stores field values of point in last values cache
+    void cacheLastValues(Point &point);
+    // Finds or creates cache entry for the key
+    LastValue *getCachedValue(const String &key, bool create);
     // Sends POST request with data in body
     int postData(const char *data);
-    // Prepares batch from data in buffer`
-    char *prepareBatch(int &size);
+    // Prepares batch of up to maxRecords records with up to maxLines lines in total from data in buffer, at least one record is taken.
+    // Returns number of records in size and number of lines in lines. Returns nullptr with non zero size if memory cannot be allocated
+    char *prepareBatch(int &size, int &lines, uint16_t maxLines, uint16_t maxRecords);
     void setUrls();
+    // Resolves server address if caching is enabled and cached address expired
+    void resolveServer();
+    // Returns server host name parsed from server url
+    String getServerHost() const;
+    // Switches to the fastest healthy server 
+    void selectServer();
+    // Returns true if server can be used
+    bool isServerHealthy(uint8_t index) const;
+    // Returns true if there is other healthy server than the current one
+    bool hasHealthyServer() const;
+    // Updates health of current server according to last request result and duration
+    void updateServerHealth(uint32_t duration);
 #ifdef INFLUXDB_CLIENT_TESTING
 public:
     String *getBuffer() { return _pointsBuffer; }
     void setServerUrl(const char *serverUrl) {
       _serverUrl = serverUrl;
+      _servers[_currentServer].url = serverUrl;
+      _serverIP = IPAddress();
       setUrls();
     }
 #endif         
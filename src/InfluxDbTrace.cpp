@@ -0,0 +1,117 @@
+/**
+ *
+ * InfluxDbTrace.cpp: Tracing of write and query phases for InfluxDB Client for Arduino
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 InfluxData
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+#include "InfluxDbTrace.h"
+
+#ifdef INFLUXDB_CLIENT_TRACE
+
+void InfluxDBTrace::record(TracePhase phase, bool begin) {
+    uint32_t time = micros();
+    Event &e = _events[_next];
+    e.time = time;
+    e.phase = phase;
+    e.begin = begin;
+    _next = (_next + 1) % INFLUXDB_CLIENT_TRACE_SIZE;
+    if(_count < INFLUXDB_CLIENT_TRACE_SIZE) {
+        _count++;
+    }
+    if(_callback) {
+        _callback(phase, begin, time);
+    }
+}
+
+const InfluxDBTrace::Event &InfluxDBTrace::event(uint8_t index) const {
+    return _events[(_next + INFLUXDB_CLIENT_TRACE_SIZE - _count + index) % INFLUXDB_CLIENT_TRACE_SIZE];
+}
+
+const __FlashStringHelper *InfluxDBTrace::phaseName(TracePhase phase) {
+    switch(phase) {
+        case TracePhase::Write:
+            return F("write");
+        case TracePhase::Query:
+            return F("query");
+        case TracePhase::Serialize:
+            return F("serialize");
+        case TracePhase::DNS:
+            return F("dns");
+        case TracePhase::HTTPRequest:
+            return F("http-request");
+        case TracePhase::ReadResponse:
+            return F("read-response");
+        case TracePhase::Inflate:
+            return F("inflate");
+        case TracePhase::Pacing:
+            return F("pacing");
+    }
+    return F("unknown");
+}
+
+void InfluxDBTrace::print(Print &out) const {
+    for(uint8_t i = 0; i < _count; i++) {
+        const Event &e = event(i);
+        out.print(e.time);
+        out.print(F("us "));
+        out.print(phaseName(e.phase));
+        if(e.begin) {
+            out.println(F(" begin"));
+            continue;
+        }
+        out.print(F(" end"));
+        // find matching begin, phase doesn't nest into itself
+        for(int j = i - 1; j >= 0; j--) {
+            const Event &b = event(j);
+            if(b.phase == e.phase) {
+                if(b.begin) {
+                    out.print(F(", took "));
+                    out.print(e.time - b.time);
+                    out.print(F("us"));
+                }
+                break;
+            }
+        }
+        out.println();
+    }
+}
+
+void InfluxDBTrace::printChromeTrace(Print &out) const {
+    out.print(F("{\"traceEvents\":["));
+    for(uint8_t i = 0; i < _count; i++) {
+        const Event &e = event(i);
+        if(i > 0) {
+            out.print(',');
+        }
+        out.print(F("{\"name\":\""));
+        out.print(phaseName(e.phase));
+        out.print(F("\",\"ph\":\""));
+        out.print(e.begin ? 'B' : 'E');
+        out.print(F("\",\"ts\":"));
+        out.print(e.time);
+        out.print(F(",\"pid\":1,\"tid\":1}"));
+    }
+    out.println(F("],\"displayTimeUnit\":\"ms\"}"));
+}
+
+#endif //INFLUXDB_CLIENT_TRACE
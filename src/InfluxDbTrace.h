@@ -0,0 +1,101 @@
+/**
+ *
+ * InfluxDbTrace.h: Tracing of write and query phases for InfluxDB Client for Arduino
+ *
+ * MIT License
+ *
+ * Copyright (c) 2020 InfluxData
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+#ifndef _INFLUXDB_TRACE_H_
+#define _INFLUXDB_TRACE_H_
+
+// Uncomment bellow to record timing of write and query phases and rebuild sketch
+//#define INFLUXDB_CLIENT_TRACE
+
+#ifdef INFLUXDB_CLIENT_TRACE
+
+#include "Arduino.h"
+
+// Number of events kept in trace, the oldest events are overwritten
+#define INFLUXDB_CLIENT_TRACE_SIZE 64
+
+// Traced phases
+enum class TracePhase : uint8_t {
+    // Whole write request in flushBuffer()
+    Write = 0,
+    // Whole query()
+    Query,
+    // Creating line protocol of points and batches
+    Serialize,
+    // Resolving server address, when DNS caching is enabled (otherwise it is part of HTTPRequest)
+    DNS,
+    // Connecting, sending request and waiting for response status inside HTTPClient
+    HTTPRequest,
+    // Reading response body
+    ReadResponse,
+    // Reading and decompressing gzip response body
+    Inflate,
+    // Checking write rate limit
+    Pacing
+};
+
+// Called on each recorded event, time is in microseconds
+typedef void (*TraceCallback)(TracePhase phase, bool begin, uint32_t time);
+
+// Records begin and end events of phases into a ring buffer
+class InfluxDBTrace {
+  public:
+    // Records begin of phase
+    void begin(TracePhase phase) { record(phase, true); }
+    // Records end of phase
+    void end(TracePhase phase) { record(phase, false); }
+    // Removes all events
+    void clear() { _count = 0; _next = 0; }
+    // Sets function called on each event, e.g. for forwarding events to own tracing system
+    void setCallback(TraceCallback callback) { _callback = callback; }
+    // Prints events as text, end events with phase duration
+    void print(Print &out) const;
+    // Prints events in the Chrome trace event JSON format, which can be displayed by chrome://tracing or Perfetto UI
+    void printChromeTrace(Print &out) const;
+    // Returns name of phase
+    static const __FlashStringHelper *phaseName(TracePhase phase);
+  protected:
+    struct Event {
+        // Time in microseconds
+        uint32_t time;
+        TracePhase phase;
+        bool begin;
+    };
+    Event _events[INFLUXDB_CLIENT_TRACE_SIZE];
+    // Index of the next event
+    uint8_t _next = 0;
+    // Number of events in buffer
+    uint8_t _count = 0;
+    TraceCallback _callback = nullptr;
+
+    void record(TracePhase phase, bool begin);
+    // Returns event at index, 0 is the oldest one
+    const Event &event(uint8_t index) const;
+};
+
+#endif //INFLUXDB_CLIENT_TRACE
+
+#endif //_INFLUXDB_TRACE_H_
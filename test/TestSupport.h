@@ -17,6 +17,18 @@ bool deleteAll(String url) {
   return code == 204;
 }
 
+// Sets faults injected by the mock server, empty faults clears them
+bool setMockFaults(String url, String faults) {
+  String faultsUrl = url + "/mock/faults?" + faults;
+  HTTPClient http;
+  int code = 0;
+  if(http.begin(faultsUrl)) {
+    code = http.POST("");
+    http.end();
+  }
+  return code == 204;
+}
+
 
 int countParts(String &str, char separator) {
   int lines = 0;
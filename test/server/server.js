@@ -1,10 +1,18 @@
 const express = require('express');
 const readline = require('readline');
+const zlib = require('zlib');
 var os = require('os');
 
 const app = express();
-const port = 999;
+// port can be set by the first argument, so more servers can run at once
+const port = process.argv[2] || 999;
 var pointsdb = []; 
+// soak testing state, see resetSoak()
+var faults = {};
+var stats = {};
+var received = new Set();
+var storm = { status: 0, remaining: 0 };
+resetSoak({});
 
 app.use (function(req, res, next) {
     var data='';
@@ -14,6 +22,7 @@ app.use (function(req, res, next) {
     });
 
     req.on('end', function() {
+        req.rawBody = data;
         req.body = parsePoints(data);
         next();
     });
@@ -24,11 +33,36 @@ app.get('/ready', (req,res) => {
 })
 
 app.post('/api/v2/write', (req,res) => {
+    if(faults.delay > 0) {
+        setTimeout(() => handleWrite(req, res), faults.delay);
+    } else {
+        handleWrite(req, res);
+    }
+})
+
+function handleWrite(req, res) {
+    if(faults.status > 0) {
+        res.status(faults.status).send("Server unavailable");
+        return;
+    }
     if(checkWriteParams(req, res) && handleAuthentication(req, res)) {
         var points = req.body;
+        if(Array.isArray(points) && points.length > 0 && points[0].measurement == 'soak') {
+            soakWrite(req, res, points);
+            return;
+        }
         if(Array.isArray(points) && points.length > 0) {
             var point = points[0];
-            if(point.tags.hasOwnProperty('direction')) {
+            var invalidIndex = points.findIndex(p => p.tags.direction == 'invalid');
+            var maxPoints = points.find(p => p.tags.hasOwnProperty('maxpoints'));
+            if(invalidIndex >= 0) {
+                // whole batch is rejected because of a single line
+                points = [];
+                res.status(400).send(`{"code":"invalid","message":"unable to parse line ${invalidIndex + 1}"}`);
+            } else if(maxPoints && points.length > parseInt(maxPoints.tags.maxpoints)) {
+                points = [];
+                res.status(413).send(`{"code":"request too large","message":"max ${maxPoints.tags.maxpoints} points allowed"}`);
+            } else if(point.tags.hasOwnProperty('direction')) {
                 switch(point.tags.direction) {
                     case '429-1':
                         res.set("Retry-After","30");
@@ -74,7 +108,7 @@ app.post('/api/v2/write', (req,res) => {
     if(res.statusCode != 204) {
         console.log('Responded with ' + res.statusCode);
     }
-})
+}
 
 app.post('/api/v2/delete', (req,res) => {
     console.log('Deleteting points');
@@ -84,15 +118,59 @@ app.post('/api/v2/delete', (req,res) => {
 
 app.post('/api/v2/query', (req,res) => {
     if(checkQueryParams(req, res) && handleAuthentication(req, res)) {
-        if(pointsdb.length > 0) {
+        if(req.rawBody.indexOf('|> last()') >= 0) {
+            res.status(200).send(queryLastValue(req.rawBody));
+        } else if(pointsdb.length > 0) {
             console.log('query: ' + pointsdb.length + ' points');
-            res.status(200).send(convertToCSV(pointsdb));
+            var csv = convertToCSV(pointsdb);
+            var accept = req.get('Accept-Encoding');
+            // query text can control compressed reply, e.g. "gzip-off"
+            var gzipMode = (req.rawBody.match(/gzip-(\w+)/) || [])[1];
+            if(accept && accept.indexOf('gzip') >= 0 && gzipMode != 'off') {
+                var data = zlib.gzipSync(csv);
+                if(gzipMode == 'truncated') {
+                    data = data.slice(0, data.length / 2);
+                } else if(gzipMode == 'corrupted') {
+                    // damage CRC in trailer
+                    data[data.length - 8] ^= 0xff;
+                }
+                res.set('Content-Encoding', 'gzip');
+                res.status(200);
+                if(gzipMode == 'length') {
+                    res.set('Content-Length', String(data.length));
+                    res.end(data);
+                    return;
+                }
+                // send compressed data in chunks, as the real server does
+                for(var i = 0; i < data.length; i += 1000) {
+                    res.write(data.slice(i, i + 1000));
+                }
+                res.end();
+            } else {
+                res.status(200).send(csv);
+            }
         } else {
             res.status(200).end();
         }
     }
 });
 
+// Sets fault injection for soak test points and resets statistics
+app.post('/mock/faults', (req,res) => {
+    resetSoak(req.query);
+    console.log('Soak faults: ' + JSON.stringify(faults));
+    res.status(204).end();
+});
+
+// Returns soak statistics. Optional expected param is the count of points sent by the client
+app.get('/mock/stats', (req,res) => {
+    var result = Object.assign({}, stats);
+    result.unique = received.size;
+    var expected = req.query['expected'] ? parseInt(req.query['expected']) : stats.maxSeq + 1;
+    result.lost = expected - received.size;
+    res.status(200).json(result);
+});
+
 var rl = readline.createInterface(process.stdin, process.stdout);
 
 rl.on('line', function(line) {
@@ -169,6 +247,71 @@ function parsePoints(data) {
     }
 }
 
+function resetSoak(query) {
+    faults = {
+        latency: parseInt(query.latency || 0),          // max random delay of a write reply in ms
+        delay: parseInt(query.delay || 0),              // fixed delay of every write reply in ms, also for regular points
+        status: parseInt(query.status || 0),            // status code replied to every write, also for regular points
+        reset: parseFloat(query.reset || 0),            // probability of closing connection without reply
+        partial: parseFloat(query.partial || 0),        // probability of truncated reply after points were stored
+        storm429: parseFloat(query.storm429 || 0),      // probability of starting a storm of 429 replies
+        storm503: parseFloat(query.storm503 || 0),      // probability of starting a storm of 503 replies
+        stormLength: parseInt(query.stormLength || 10), // count of requests rejected in a storm
+        retryAfter: parseInt(query.retryAfter || 1)     // Retry-After value sent in a storm
+    };
+    stats = { requests: 0, points: 0, duplicates: 0, maxSeq: -1, resets: 0, partials: 0, throttled: 0 };
+    received = new Set();
+    storm = { status: 0, remaining: 0 };
+}
+
+// Soak points have measurement soak and field seq with sequence number, they are not stored in pointsdb,
+// only counted to find lost and duplicated points
+function soakWrite(req, res, points) {
+    stats.requests++;
+    var delay = faults.latency > 0 ? Math.floor(Math.random() * faults.latency) : 0;
+    setTimeout(() => {
+        if(storm.remaining == 0) {
+            var r = Math.random();
+            if(r < faults.storm429) {
+                storm = { status: 429, remaining: faults.stormLength };
+            } else if(r < faults.storm429 + faults.storm503) {
+                storm = { status: 503, remaining: faults.stormLength };
+            }
+        }
+        if(storm.remaining > 0) {
+            storm.remaining--;
+            stats.throttled++;
+            res.set("Retry-After", String(faults.retryAfter));
+            res.status(storm.status).send(storm.status == 429 ? "Limit exceeded" : "Server overloaded");
+            return;
+        }
+        if(Math.random() < faults.reset) {
+            stats.resets++;
+            req.socket.destroy();
+            return;
+        }
+        points.forEach(p => {
+            var seq = parseInt(p.fields.seq);
+            stats.points++;
+            if(received.has(seq)) {
+                stats.duplicates++;
+            } else {
+                received.add(seq);
+            }
+            if(seq > stats.maxSeq) {
+                stats.maxSeq = seq;
+            }
+        });
+        if(Math.random() < faults.partial) {
+            // points are stored, but client doesn't get complete reply, so it will write them again
+            stats.partials++;
+            req.socket.end('HTTP/1.1 204 No Con');
+            return;
+        }
+        res.status(204).end();
+    }, delay);
+}
+
 const AuthToken = "Token 1234567890";
 function handleAuthentication(req, res) {
     var auth = req.get('Authorization');
@@ -194,6 +337,31 @@ function checkWriteParams(req, res) {
     }
 }
 
+// Answers Flux query for the last value of a field, with filter on measurement, tags and field, as created by getLastValue
+function queryLastValue(query) {
+    var measurement = query.match(/r\._measurement == "([^"]*)"/);
+    var field = query.match(/r\._field == "([^"]*)"/);
+    var tags = {};
+    var tagRegex = /r\["([^"]*)"\] == "([^"]*)"/g;
+    var m;
+    while((m = tagRegex.exec(query)) !== null) {
+        tags[m[1]] = m[2];
+    }
+    var csv = ',result,table,_value,_field,_measurement\r\n';
+    if(!measurement || !field) {
+        return csv;
+    }
+    for(var i = pointsdb.length - 1; i >= 0; i--) {
+        var p = pointsdb[i];
+        if(p.measurement == measurement[1] && p.fields.hasOwnProperty(field[1])
+            && Object.keys(tags).every(k => p.tags[k] == tags[k])) {
+            console.log('query last value of ' + field[1]);
+            return csv + `,_result,0,${p.fields[field[1]]},${field[1]},${p.measurement}\r\n`;
+        }
+    }
+    return csv;
+}
+
 function checkQueryParams(req, res) {
     var org = req.query['org'];
     if(org != 'my-org') {
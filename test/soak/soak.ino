@@ -0,0 +1,194 @@
+/**
+ *  Soak test for InfluxDBClient.
+ *  Writes lots of points to the mock server (test/server) while it injects faults
+ *  (latency, connection resets, truncated replies, 429/503 storms) and reports
+ *  throughput, writePoint latency percentiles, minimal free heap and, at the end,
+ *  points lost and duplicated as counted by the server.
+ *  Run the mock server on a host first: node server.js
+ */
+
+#include <InfluxDbClient.h>
+#if defined(ESP32)
+#include <WiFiMulti.h>
+#include <HTTPClient.h>
+WiFiMulti wifiMulti;
+#define DEVICE "ESP32"
+#elif defined(ESP8266)
+#include <ESP8266WiFiMulti.h>
+#include <ESP8266HTTPClient.h>
+ESP8266WiFiMulti wifiMulti;
+#define DEVICE "ESP8266"
+#endif
+
+#define SOAK_SERVER_URL "http://192.168.88.36:999"
+#define SOAK_ORG "my-org"
+#define SOAK_BUCKET "my-bucket"
+#define SOAK_TOKEN "1234567890"
+#define SOAK_SSID "SSID"
+#define SOAK_PASS "password"
+// Total count of points to write
+#define SOAK_POINTS 1000000UL
+// Points per second, 0 means as fast as possible
+#define SOAK_RATE 0
+#define SOAK_BATCH_SIZE 100
+#define SOAK_BUFFER_SIZE 500
+// Interval of progress reports in ms
+#define SOAK_REPORT_INTERVAL 10000
+// Faults injected by the mock server, see test/server/Readme.md
+#define SOAK_FAULTS "latency=200&reset=0.01&partial=0.01&storm429=0.002&storm503=0.002&stormLength=5&retryAfter=1"
+
+InfluxDBClient client(SOAK_SERVER_URL, SOAK_ORG, SOAK_BUCKET, SOAK_TOKEN);
+Point point("soak");
+
+// Latency histogram, each power of 2 of microseconds is split to 4 buckets
+#define HISTOGRAM_SIZE 128
+uint32_t histogram[HISTOGRAM_SIZE];
+uint32_t histogramCount = 0;
+uint32_t maxLatency = 0;
+
+unsigned long seq = 0;
+unsigned long startTime = 0;
+unsigned long lastReport = 0;
+unsigned long lastReportSeq = 0;
+uint32_t minFreeHeap = UINT32_MAX;
+bool finished = false;
+
+void setup() {
+    Serial.begin(115200);
+    Serial.println();
+
+    WiFi.mode(WIFI_STA);
+    wifiMulti.addAP(SOAK_SSID, SOAK_PASS);
+    Serial.print("Connecting to wifi");
+    while (wifiMulti.run() != WL_CONNECTED) {
+        Serial.print(".");
+        delay(500);
+    }
+    Serial.println();
+    Serial.printf("Connected to %s, IP %s\n", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
+
+    if(!mockRequest("POST", "/mock/faults?" SOAK_FAULTS, nullptr)) {
+        Serial.println("Cannot set faults, is the mock server running?");
+    }
+
+    client.setWriteOptions(WritePrecision::NoTime, SOAK_BATCH_SIZE, SOAK_BUFFER_SIZE, 1);
+    point.addTag("device", DEVICE);
+
+    Serial.printf("Writing %lu points, batch %d, buffer %d\n", SOAK_POINTS, SOAK_BATCH_SIZE, SOAK_BUFFER_SIZE);
+    startTime = lastReport = millis();
+}
+
+void loop() {
+    if(finished) {
+        delay(1000);
+        return;
+    }
+    if(seq < SOAK_POINTS) {
+#if SOAK_RATE > 0
+        if(seq * 1000 / SOAK_RATE > millis() - startTime) {
+            return;
+        }
+#endif
+        point.clearFields();
+        point.addField("seq", seq);
+        point.addField("value", seq % 1000);
+        unsigned long start = micros();
+        client.writePoint(point);
+        recordLatency(micros() - start);
+        seq++;
+        updateMinFreeHeap();
+    } else {
+        finish();
+    }
+    if(millis() - lastReport >= SOAK_REPORT_INTERVAL) {
+        report();
+    }
+}
+
+void finish() {
+    Serial.println("Flushing buffer");
+    unsigned long start = millis();
+    // retries are scheduled by the client, just keep trying until buffer is empty
+    while(!client.isBufferEmpty() && millis() - start < 300000) {
+        client.flushBuffer();
+        delay(100);
+    }
+    report();
+    String stats;
+    if(mockRequest("GET", "/mock/stats?expected=" + String(seq), &stats)) {
+        Serial.printf("Server stats: %s\n", stats.c_str());
+    }
+    Serial.printf("Soak %s\n", client.isBufferEmpty() ? "FINISHED" : "FINISHED WITH POINTS IN BUFFER");
+    finished = true;
+}
+
+void report() {
+    unsigned long now = millis();
+    float rate = (seq - lastReportSeq) * 1000.0 / (now - lastReport);
+    float totalRate = seq * 1000.0 / (now - startTime);
+    Serial.printf("[%lus] points %lu, rate %.1f/s (avg %.1f/s), latency p50 %luus, p99 %luus, max %luus, min free heap %u\n",
+        (now - startTime) / 1000, seq, rate, totalRate,
+        (unsigned long)percentile(50), (unsigned long)percentile(99), (unsigned long)maxLatency, (unsigned)minFreeHeap);
+    if(client.getLastStatusCode() >= 300 || client.getLastStatusCode() < 0) {
+        Serial.printf("  last error %d: %s\n", client.getLastStatusCode(), client.getLastErrorMessage().c_str());
+    }
+    lastReport = now;
+    lastReportSeq = seq;
+}
+
+uint8_t latencyBucket(uint32_t us) {
+    if(us < 4) {
+        return us;
+    }
+    uint8_t msb = 31 - __builtin_clz(us);
+    return msb * 4 + ((us >> (msb - 2)) & 3) - 4;
+}
+
+// Upper bound of latencies in a bucket
+uint32_t bucketLimit(uint8_t bucket) {
+    if(bucket < 4) {
+        return bucket;
+    }
+    uint8_t msb = (bucket + 4) / 4;
+    uint64_t limit = ((uint64_t)(4 + (bucket & 3) + 1) << (msb - 2)) - 1;
+    return limit > UINT32_MAX ? UINT32_MAX : limit;
+}
+
+void recordLatency(uint32_t us) {
+    histogram[latencyBucket(us)]++;
+    histogramCount++;
+    if(us > maxLatency) {
+        maxLatency = us;
+    }
+}
+
+uint32_t percentile(uint8_t p) {
+    uint32_t limit = ((uint64_t)histogramCount * p + 99) / 100;
+    uint32_t count = 0;
+    for(int i = 0; i < HISTOGRAM_SIZE; i++) {
+        count += histogram[i];
+        if(count >= limit && count > 0) {
+            return bucketLimit(i);
+        }
+    }
+    return 0;
+}
+
+void updateMinFreeHeap() {
+    uint32_t freeHeap = ESP.getFreeHeap();
+    if(freeHeap < minFreeHeap) {
+        minFreeHeap = freeHeap;
+    }
+}
+
+bool mockRequest(const char *method, String path, String *response) {
+    WiFiClient wifi;
+    HTTPClient http;
+    http.begin(wifi, String(SOAK_SERVER_URL) + path);
+    int code = http.sendRequest(method);
+    if(response && code == 200) {
+        *response = http.getString();
+    }
+    http.end();
+    return code >= 200 && code < 300;
+}
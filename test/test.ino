@@ -20,6 +20,7 @@ String deviceName = "ESP8266";
 #endif
 
 #define INFLUXDB_CLIENT_TESTING_URL "http://192.168.88.36:999"
+#define INFLUXDB_CLIENT_TESTING_URL2 "http://192.168.88.36:998"
 #define INFLUXDB_CLIENT_TESTING_ORG "my-org"
 #define INFLUXDB_CLIENT_TESTING_BUC "my-bucket"
 #define INFLUXDB_CLIENT_TESTING_TOK "1234567890"
@@ -46,10 +47,21 @@ void setup() {
 
     //tests
     testPoint();
+    testRecordValidation();
     testInit();
     testBasicFunction();
     testFailedWrites();
+    testBatchSplitting();
     testTimestamp();
+    testServerTime();
+    testRTCBuffer();
+    testWarmup();
+    testFailover();
+    testLastValueCache();
+    testQueryCompression();
+    testWriteSamples();
+    testDeferredSerialization();
+    testWriteRateLimit();
     testRetryOnFailedConnection();
     testBufferOverwriteBatchsize1();
     testBufferOverwriteBatchsize5();
@@ -137,6 +149,66 @@ void testPoint() {
     p.addField("nan", (double)NAN);
     TEST_ASSERT(!p.hasFields());
 
+    p.addField("field1", 1);
+    line = p.toLineProtocol();
+    TEST_ASSERTM(line == "test field1=1i", line);
+
+    Point pe("meas ure,ment=1");
+    pe.addTag("tag 1", "tag=val,ue");
+    pe.addTag("tag2", "no\\escape\"");
+    pe.addField("fie=ld,1", "te xt \"quo\\ted\"");
+    pe.addField("field2", "a=b,c");
+    line = pe.toLineProtocol();
+    testLine = "meas\\ ure\\,ment=1,tag\\ 1=tag\\=val\\,ue,tag2=no\\escape\" fie\\=ld\\,1=\"te xt \\\"quo\\\\ted\\\"\",field2=\"a=b,c\"";
+    TEST_ASSERTM(line == testLine, line);
+
+    TEST_END();
+}
+
+void testRecordValidation() {
+    TEST_INIT("testRecordValidation");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_BAD_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::NoTime, 10, 20);
+    const char *valid[] = {
+        "a,a=1 a=3",
+        "m f=1i,g=2u,h=-1.5e-3,i=t,j=FALSE 1592400000",
+        "m\\ x,t\\,1=v\\ 2 f=\"quo\\\"ted, text\"",
+        "m f=1\r\n",
+        "m f=1i\nm f=2i 12",
+        "m f=9223372036854775807i,g=-9223372036854775808i,h=18446744073709551615u,i=007i",
+    };
+    for (int i = 0; i < 6; i++) {
+        String rec = valid[i];
+        TEST_ASSERTM(client.writeRecord(rec), rec + ": " + client.getLastErrorMessage());
+    }
+    TEST_ASSERTM(client.getBuffer()[3] == "m f=1", client.getBuffer()[3]);
+    const char *invalid[] = {
+        "",
+        "m",
+        " m f=1",
+        "m,t f=1",
+        "m,t= f=1",
+        "m f=",
+        "m f=abc",
+        "m f=-1u",
+        "m f=\"abc",
+        "m f=1,",
+        "m f=1 12a",
+        "m f=1i\nm f",
+        "m,t=a=b f=1",
+        "m f=9223372036854775808i",
+        "m f=-9223372036854775809i",
+        "m f=18446744073709551616u",
+        "m f=99999999999999999999999i",
+    };
+    for (int i = 0; i < 17; i++) {
+        String rec = invalid[i];
+        TEST_ASSERTM(!client.writeRecord(rec), rec);
+        TEST_ASSERTM(client.getLastErrorMessage().startsWith("Invalid record: "), client.getLastErrorMessage());
+    }
+    TEST_ASSERT(client.getBuffer()[6] == "");
+
     TEST_END();
 }
 
@@ -630,12 +702,61 @@ void testFailedWrites() {
 
     q = client.query(query);
     lines = getLines(q, count);
-    //3 batches should be skipped
-    TEST_ASSERT(count == 16);  //15 points+header
-    TEST_ASSERTM(lines[1].indexOf(",5") > 0, lines[1]);
-    TEST_ASSERTM(lines[6].indexOf(",15") > 0, lines[6]);
-    TEST_ASSERTM(lines[11].indexOf(",25") > 0, lines[11]);
+    //batches with 400 are split and only first point is skipped, batch with 500 is skipped
+    TEST_ASSERTM(count == 24, String(count));  //23 points+header
+    TEST_ASSERTM(lines[1].indexOf(",1") > 0, lines[1]);
+    TEST_ASSERTM(lines[5].indexOf(",5") > 0, lines[5]);
+    TEST_ASSERTM(lines[10].indexOf(",11") > 0, lines[10]);
+    TEST_ASSERTM(lines[19].indexOf(",25") > 0, lines[19]);
+    delete[] lines;
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testBatchSplitting() {
+    TEST_INIT("testBatchSplitting");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::NoTime, 10, 20);
+    TEST_ASSERT(client.validateConnection());
+    // server rejects whole batch because of invalid points
+    for (int i = 0; i < 10; i++) {
+        Point *p = createPoint("test1");
+        if (i == 3 || i == 7) {
+            p->addTag("direction", "invalid");
+        }
+        p->addField("index", i);
+        TEST_ASSERTM(client.writePoint(*p) == (i < 9), String("i=") + i);
+        delete p;
+    }
+    TEST_ASSERT(client.isBufferEmpty());
+    TEST_ASSERT(client.getRejectedCount() == 2);
+    TEST_ASSERT(client.getLastStatusCode() == 400);
+    String query = "select";
+    String q = client.query(query);
+    int count;
+    String *lines = getLines(q, count);
+    TEST_ASSERTM(count == 9, String(count));  //8 points+header
+    TEST_ASSERTM(lines[3].indexOf(",2") > 0, lines[3]);
+    TEST_ASSERTM(lines[4].indexOf(",4") > 0, lines[4]);
+    TEST_ASSERTM(lines[6].indexOf(",6") > 0, lines[6]);
+    TEST_ASSERTM(lines[7].indexOf(",8") > 0, lines[7]);
     delete[] lines;
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+
+    // server accepts at most 3 points at once
+    for (int i = 0; i < 10; i++) {
+        Point *p = createPoint("test1");
+        p->addTag("maxpoints", "3");
+        p->addField("index", i);
+        TEST_ASSERTM(client.writePoint(*p), String("i=") + i);
+        delete p;
+    }
+    TEST_ASSERT(client.isBufferEmpty());
+    TEST_ASSERT(client.getRejectedCount() == 2);
+    q = client.query(query);
+    TEST_ASSERTM(countLines(q) == 11, q);  //10 points+header
 
     TEST_END();
     deleteAll(INFLUXDB_CLIENT_TESTING_URL);
@@ -708,6 +829,428 @@ void testTimestamp() {
     deleteAll(INFLUXDB_CLIENT_TESTING_URL);
 }
 
+void testServerTime() {
+    TEST_INIT("testServerTime");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    TEST_ASSERT(client.getServerTime() == 0);
+    TEST_ASSERT(client.validateConnection());
+    unsigned long serverTime = client.getServerTime();
+    long diff = (long)(serverTime - time(nullptr));
+    TEST_ASSERTM(abs(diff) <= 2, String(serverTime) + " vs " + String((unsigned long)time(nullptr)));
+
+    client.setUseServerTime(true);
+    client.setWriteOptions(WritePrecision::MS, 1, 5);
+    Point *p = createPoint("test1");
+    TEST_ASSERT(client.writePoint(*p));
+    TEST_ASSERT(p->hasTime());
+    String line = p->toLineProtocol();
+    int partsCount;
+    String *parts = getParts(line, ' ', partsCount);
+    TEST_ASSERTM(partsCount == 3, line);
+    TEST_ASSERTM(parts[2].length() == 13, parts[2]);
+    TEST_ASSERTM(parts[2].startsWith(String(serverTime).substring(0, 8)), parts[2]);
+    delete[] parts;
+    delete p;
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testRTCBuffer() {
+    TEST_INIT("testRTCBuffer");
+    {
+        InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+        client.setWriteOptions(WritePrecision::NoTime, 5, 10);
+        client.setRTCBuffer(true);
+        client.resetBuffer();
+        for (int i = 0; i < 3; i++) {
+            Point *p = createPoint("test1");
+            p->addField("index", i);
+            TEST_ASSERTM(client.writePoint(*p), String("i=") + i);
+            delete p;
+        }
+        TEST_ASSERT(!client.isBufferEmpty());
+    }
+    // new instance simulates wake up from deep sleep
+    {
+        InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+        client.setWriteOptions(WritePrecision::NoTime, 5, 10);
+        client.setRTCBuffer(true);
+        TEST_ASSERT(!client.isBufferEmpty());
+        TEST_ASSERT(client.getBuffer()[0].indexOf("index=0i") > 0);
+        for (int i = 3; i < 5; i++) {
+            Point *p = createPoint("test1");
+            p->addField("index", i);
+            TEST_ASSERTM(client.writePoint(*p), String("i=") + i);
+            delete p;
+        }
+        TEST_ASSERT(client.isBufferEmpty());
+        String query = "select";
+        String q = client.query(query);
+        int count;
+        String *lines = getLines(q, count);
+        TEST_ASSERTM(count == 6, String(count));  //5 points+header
+        TEST_ASSERT(lines[1].indexOf(",0") > 0);
+        TEST_ASSERT(lines[5].indexOf(",4") > 0);
+        delete[] lines;
+    }
+    {
+        InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+        client.setWriteOptions(WritePrecision::NoTime, 5, 10);
+        client.setRTCBuffer(true);
+        TEST_ASSERT(client.isBufferEmpty());
+        // records with more lines are kept as they are
+        String record = "test1 index=5i\ntest1 index=6i";
+        TEST_ASSERT(client.writeRecord(record));
+        record = "test1 index=7i";
+        TEST_ASSERT(client.writeRecord(record));
+    }
+    {
+        InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+        client.setWriteOptions(WritePrecision::NoTime, 5, 10);
+        client.setRTCBuffer(true);
+        String *buff = client.getBuffer();
+        TEST_ASSERTM(buff[0] == "test1 index=5i\ntest1 index=6i", buff[0]);
+        TEST_ASSERTM(buff[1] == "test1 index=7i", buff[1]);
+        TEST_ASSERTM(buff[2] == "", buff[2]);
+        client.resetBuffer();
+    }
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testWarmup() {
+    TEST_INIT("testWarmup");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_BAD_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::NoTime, 1, 5, 60, true);
+    client.setDNSCacheTTL(60);
+    TEST_ASSERT(!client.warmup());
+    TEST_ASSERT(client.getLastStatusCode() < 0);
+
+    client.setServerUrl(INFLUXDB_CLIENT_TESTING_URL);
+    TEST_ASSERT(client.warmup());
+    Point *p = createPoint("test1");
+    TEST_ASSERT(client.writePoint(*p));
+    delete p;
+    String query = "select";
+    String q = client.query(query);
+    TEST_ASSERT(countLines(q) == 2);  //1 point+header
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testFailover() {
+    TEST_INIT("testFailover");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_BAD_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::NoTime, 1, 5);
+    TEST_ASSERT(!client.addServerUrl("https://192.168.88.36:999"));
+    TEST_ASSERT(client.addServerUrl(INFLUXDB_CLIENT_TESTING_URL));
+    // first write fails on primary server and goes to the second one
+    Point *p = createPoint("test1");
+    TEST_ASSERT(client.writePoint(*p));
+    delete p;
+    TEST_ASSERTM(client.getServerUrl() == INFLUXDB_CLIENT_TESTING_URL, client.getServerUrl());
+    for (int i = 0; i < 5; i++) {
+        p = createPoint("test1");
+        TEST_ASSERTM(client.writePoint(*p), String("i=") + i);
+        delete p;
+    }
+    // failed server is not used for some time
+    TEST_ASSERTM(client.getServerUrl() == INFLUXDB_CLIENT_TESTING_URL, client.getServerUrl());
+    String query = "select";
+    String q = client.query(query);
+    TEST_ASSERT(countLines(q) == 7);  //6 points+header
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+
+    // second server runs on other port, the first one is slowed down
+    TEST_ASSERT(setMockFaults(INFLUXDB_CLIENT_TESTING_URL, "delay=300"));
+    InfluxDBClient client2(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    TEST_ASSERT(client2.addServerUrl(INFLUXDB_CLIENT_TESTING_URL2));
+    for (int i = 0; i < 10; i++) {
+        p = createPoint("test1");
+        TEST_ASSERTM(client2.writePoint(*p), String("i=") + i);
+        delete p;
+    }
+    // not measured server is tried and then the faster one is preferred
+    TEST_ASSERTM(client2.getServerUrl() == INFLUXDB_CLIENT_TESTING_URL2, client2.getServerUrl());
+    // points are spread among servers, according to their response time
+    InfluxDBClient client3(INFLUXDB_CLIENT_TESTING_URL2, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    q = client.query(query);
+    String q2 = client3.query(query);
+    int count = countLines(q), count2 = countLines(q2);
+    TEST_ASSERTM((count ? count - 1 : 0) + (count2 ? count2 - 1 : 0) == 10, String(count) + "," + count2);
+    // only the first write went to the slow server
+    TEST_ASSERTM(count == 2, String(count));
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL2);
+
+    // bad gateway reply of the primary server doesn't discard data when there is another server
+    TEST_ASSERT(setMockFaults(INFLUXDB_CLIENT_TESTING_URL, "status=502"));
+    InfluxDBClient client4(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    TEST_ASSERT(client4.addServerUrl(INFLUXDB_CLIENT_TESTING_URL2));
+    p = createPoint("test1");
+    TEST_ASSERT(client4.writePoint(*p));
+    delete p;
+    TEST_ASSERTM(client4.getServerUrl() == INFLUXDB_CLIENT_TESTING_URL2, client4.getServerUrl());
+    TEST_ASSERT(client4.isBufferEmpty());
+    q2 = client3.query(query);
+    TEST_ASSERTM(countLines(q2) == 2, q2);  //1 point+header
+
+    TEST_END();
+    setMockFaults(INFLUXDB_CLIENT_TESTING_URL, "");
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL2);
+}
+
+void testLastValueCache() {
+    TEST_INIT("testLastValueCache");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::NoTime, 5, 10);
+    client.setLastValueCache(4);
+    Point setpoint("set point");
+    setpoint.addTag("room", "living room");
+    for (int i = 0; i < 3; i++) {
+        setpoint.clearFields();
+        setpoint.addField("temperature", 20.5f + i);
+        setpoint.addField("mode", i % 2 ? "eco" : "comfort \"plus\"");
+        setpoint.addField("count", i);
+        TEST_ASSERT(client.writePoint(setpoint));
+    }
+    Point series("set point");
+    series.addTag("room", "living room");
+    String value = client.getLastValue(series, "temperature");
+    TEST_ASSERTM(value == "22.50", value);
+    value = client.getLastValue(series, "mode");
+    TEST_ASSERTM(value == "comfort \"plus\"", value);
+    value = client.getLastValue(series, "count");
+    TEST_ASSERTM(value == "2", value);
+    // values were taken from cache, not from server
+    TEST_ASSERT(client.getLastStatusCode() == 0);
+
+    Point other("setpoint");
+    other.addTag("room", "kitchen");
+    other.addField("temperature", 18.5);
+    other.addField("count", 7);
+    TEST_ASSERT(client.writePoint(other));
+    TEST_ASSERT(client.flushBuffer());
+    // other client doesn't have the value in cache and queries it from server
+    InfluxDBClient client2(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client2.setLastValueCache(4);
+    Point series2("setpoint");
+    series2.addTag("room", "kitchen");
+    value = client2.getLastValue(series2, "temperature");
+    TEST_ASSERTM(value == "18.50", value);
+    TEST_ASSERT(client2.getLastStatusCode() == 200);
+    value = client2.getLastValue(series2, "count");
+    TEST_ASSERTM(value == "7", value);
+    // not existing field is not found
+    value = client2.getLastValue(series2, "humidity");
+    TEST_ASSERTM(value == "", value);
+    TEST_ASSERT(client2.getLastStatusCode() == 200);
+    // other series is not found
+    series2.addTag("floor", "1");
+    value = client2.getLastValue(series2, "temperature");
+    TEST_ASSERTM(value == "", value);
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testQueryCompression() {
+    TEST_INIT("testQueryCompression");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::NoTime, 1, 50);
+    for (int i = 0; i < 30; i++) {
+        Point *p = createPoint("test1");
+        p->addField("index", i);
+        TEST_ASSERTM(client.writePoint(*p), String("i=") + i);
+        delete p;
+    }
+    // compressed chunked reply
+    String query = "select";
+    String q = client.query(query);
+    TEST_ASSERTM(countLines(q) == 31, String(countLines(q)));  //30 points+header
+    TEST_ASSERT(client.getLastStatusCode() == 200);
+    // compressed reply with known length
+    query = "select gzip-length";
+    q = client.query(query);
+    TEST_ASSERTM(countLines(q) == 31, String(countLines(q)));
+    TEST_ASSERT(client.getLastStatusCode() == 200);
+    // not compressed reply
+    query = "select gzip-off";
+    String plain = client.query(query);
+    TEST_ASSERT(client.getLastStatusCode() == 200);
+    TEST_ASSERT(plain == q);
+
+    query = "select gzip-truncated";
+    q = client.query(query);
+    TEST_ASSERTM(q == "", q);
+    TEST_ASSERTM(client.getLastStatusCode() == 0, String(client.getLastStatusCode()));
+    TEST_ASSERTM(client.getLastErrorMessage() == "Unexpected end of data", client.getLastErrorMessage());
+
+    query = "select gzip-corrupted";
+    q = client.query(query);
+    TEST_ASSERTM(q == "", q);
+    TEST_ASSERTM(client.getLastStatusCode() == 0, String(client.getLastStatusCode()));
+    TEST_ASSERTM(client.getLastErrorMessage() == "Gzip checksum mismatch", client.getLastErrorMessage());
+    // connection is recovered after error
+    query = "select";
+    q = client.query(query);
+    TEST_ASSERTM(countLines(q) == 31, String(countLines(q)));
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testWriteSamples() {
+    TEST_INIT("testWriteSamples");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::S, 3, 5);
+    client.setLastValueCache(2);
+    Point series("vibration");
+    series.addTag("axis", "x");
+    float acc[5] = { 0.5, -1.25, NAN, 2, 3.5 };
+    uint64_t timestamps[5];
+    for (int i = 0; i < 5; i++) {
+        timestamps[i] = 1600000000ULL + i;
+    }
+    TEST_ASSERT(client.writeSamples(series, "acc", acc, timestamps, 5));
+    // samples are split into records of up to batch size lines, the first full record was written immediately
+    String *buff = client.getBuffer();
+    TEST_ASSERTM(buff[0] == "vibration,axis=x acc=3.50 1600000004", buff[0]);
+    TEST_ASSERT(!client.isBufferEmpty());
+    int counts[3] = { 1, -2, 3 };
+    TEST_ASSERT(client.writeSamples(series, "count", counts, timestamps, 3));
+    TEST_ASSERTM(buff[1] == "vibration,axis=x count=1i 1600000000\nvibration,axis=x count=-2i 1600000001\nvibration,axis=x count=3i 1600000002", buff[1]);
+    // lines count towards batch size, so both records were written in separate batches
+    TEST_ASSERT(client.isBufferEmpty());
+    float nan[2] = { NAN, NAN };
+    TEST_ASSERT(!client.writeSamples(series, "acc", nan, timestamps, 2));
+    TEST_ASSERT(client.getLastValue(series, "acc") == "3.50");
+    TEST_ASSERT(client.getLastValue(series, "count") == "3");
+
+    int count;
+    String query = "";
+    String q = client.query(query);
+    String *lines = getLines(q, count);
+    TEST_ASSERTM(count == 8, String(count) + ": " + q);  //7 samples+header
+    delete[] lines;
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testDeferredSerialization() {
+    TEST_INIT("testDeferredSerialization");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::S, 3, 5);
+    client.setDeferredSerialization(2);
+    String *buff = client.getBuffer();
+    String expected[8];
+    // 8 points in buffer of 5 records, the second and the last batch wrap around the end of buffer
+    for (int i = 0; i < 8; i++) {
+        Point p(String("test") + (i % 3));
+        p.addTag("device", "esp");
+        p.addField("index", i);
+        p.setTime(1600000000UL + i);
+        expected[i] = String("test") + (i % 3) + ",esp," + i + "," + (1600000000UL + i);
+        TEST_ASSERTM(client.writePoint(p), String("i=") + i);
+        if (i == 1) {
+            // two series are kept compact
+            TEST_ASSERTM(buff[0][0] == '\x01' && buff[0].length() < p.toLineProtocol().length(), buff[0]);
+            TEST_ASSERTM(buff[1][0] == '\x01', buff[1]);
+        }
+        if (i == 2) {
+            // points of the third one as line protocol
+            TEST_ASSERTM(buff[2] == p.toLineProtocol(), buff[2]);
+        }
+    }
+    // pending points after wrap are compact
+    TEST_ASSERTM(buff[1][0] == '\x01', buff[1]);
+    TEST_ASSERTM(buff[2][0] == '\x01', buff[2]);
+    TEST_ASSERT(client.flushBuffer());
+    TEST_ASSERT(client.isBufferEmpty());
+
+    int count;
+    String query = "";
+    String q = client.query(query);
+    String *res = getLines(q, count);
+    TEST_ASSERTM(count == 9, String(count) + ": " + q);  //8 points+header
+    for (int i = 1; i < count; i++) {
+        res[i].trim();
+        TEST_ASSERTM(res[i] == expected[i - 1], String(i) + ":" + res[i]);
+    }
+    delete[] res;
+
+    TEST_END();
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
+void testWriteRateLimit() {
+    TEST_INIT("testWriteRateLimit");
+
+    InfluxDBClient client(INFLUXDB_CLIENT_TESTING_URL, INFLUXDB_CLIENT_TESTING_ORG, INFLUXDB_CLIENT_TESTING_BUC, INFLUXDB_CLIENT_TESTING_TOK);
+    client.setWriteOptions(WritePrecision::NoTime, 1, 5);
+    // 2 requests per 2 seconds
+    client.setWriteRateLimit(0, 2, 2);
+    for (int i = 0; i < 2; i++) {
+        Point *p = createPoint("test1");
+        TEST_ASSERTM(client.writePoint(*p), String("i=") + i);
+        delete p;
+    }
+    // limit reached, point is kept in buffer
+    Point *p = createPoint("test1");
+    TEST_ASSERT(!client.writePoint(*p));
+    delete p;
+    TEST_ASSERT(!client.isBufferEmpty());
+    TEST_ASSERT(!client.flushBuffer());
+    delay(1100);
+    TEST_ASSERT(client.flushBuffer());
+    TEST_ASSERT(client.isBufferEmpty());
+
+    // bytes limit
+    client.setWriteRateLimit(100, 0, 60);
+    p = createPoint("test1");
+    TEST_ASSERT(client.writePoint(*p));
+    TEST_ASSERT(!client.writePoint(*p));
+    delete p;
+    // no limit
+    client.setWriteRateLimit(0, 0);
+    TEST_ASSERT(client.flushBuffer());
+
+    int count;
+    String query = "";
+    String q = client.query(query);
+    String *lines = getLines(q, count);
+    TEST_ASSERTM(count == 6, String(count) + ": " + q);  //5 points+header
+    delete[] lines;
+
+    // 429 lowers 1 request per second limit, writing continues after Retry-After
+    client.setWriteRateLimit(0, 1, 1);
+    TEST_ASSERT(setMockFaults(INFLUXDB_CLIENT_TESTING_URL, "storm429=1&stormLength=1&retryAfter=1"));
+    Point soak("soak");
+    soak.addField("seq", 0);
+    TEST_ASSERT(!client.writePoint(soak));
+    TEST_ASSERTM(client.getLastStatusCode() == 429, String(client.getLastStatusCode()));
+    TEST_ASSERT(setMockFaults(INFLUXDB_CLIENT_TESTING_URL, ""));
+    TEST_ASSERT(!client.flushBuffer());
+    delay(1100);
+    TEST_ASSERT(client.flushBuffer());
+    TEST_ASSERT(client.isBufferEmpty());
+
+    TEST_END();
+    setMockFaults(INFLUXDB_CLIENT_TESTING_URL, "");
+    deleteAll(INFLUXDB_CLIENT_TESTING_URL);
+}
+
 Point *createPoint(String measurement) {
     Point *point = new Point(measurement);
     point->addTag("SSID", WiFi.SSID());